@@ -17,6 +17,7 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "utilities.h"
+#include "Frustum.h"
 
 #ifndef _CAMERA_H_
 #define _CAMERA_H_
@@ -25,6 +26,41 @@ class Camera{
 private:
   float _rotationDelta;
 
+  // Lazily computed values that depend on the camera's state. A bit in
+  // _cached is set while the matching value is up to date; touch()
+  // clears them all and gives the camera a new version.
+  typedef enum{
+    CACHED_GAZE = 1,
+    CACHED_RIGHT = 2,
+    CACHED_VIEW = 4,
+    CACHED_PROJECTION = 8,
+    CACHED_FRUSTUM = 16
+  }cached_t;
+
+  unsigned long _version;
+  unsigned int _cached;
+  float _aspect;
+  glm::vec3 _gaze;
+  glm::vec3 _right;
+  glm::mat4 _view;
+  glm::mat4 _projection;
+  Frustum _frustum;
+
+  static unsigned long nextVersion( ){
+    // Shared by all cameras so a camera assigned over another
+    // never ends up with a version seen before.
+    static unsigned long counter = 0;
+    return ++counter;
+  }
+
+  void setAspect(float windowAspectRatio){
+    if(windowAspectRatio != _aspect){
+      _aspect = windowAspectRatio;
+      _cached &= ~(CACHED_PROJECTION | CACHED_FRUSTUM);
+      _version = nextVersion( );
+    }
+  }
+
 public:
   glm::vec3 eyePosition;
   glm::vec3 upVector;
@@ -37,9 +73,25 @@ public:
 
   Camera(glm::vec3 position, glm::vec3 up, glm::vec3 la, float fieldOfViewInY, float n, float f):eyePosition(position), upVector(up), lookAt(la), fovy(fieldOfViewInY), near(n), far(f){
     _rotationDelta = deg2rad(1.0);
+    _aspect = 0.0;
+    touch( );
+  }
+
+  Camera( ): _aspect(0.0){
+    touch( );
+  }
+
+  // Changes whenever the view or the projection changes.
+  unsigned long version( ) const{
+    return _version;
   }
 
-  Camera( ){ }
+  // Call after changing eyePosition, upVector, lookAt, fovy, near or
+  // far directly; the camera's own movements already do.
+  void touch( ){
+    _cached = 0;
+    _version = nextVersion( );
+  }
   ~Camera( ){ }
 
   void draw( ){
@@ -185,26 +237,35 @@ public:
   }
 
   glm::vec3 gaze( ){
-    // this will fail miserably if gaze is a zero length vector.
-    glm::vec3 gaze = glm::normalize(lookAt - eyePosition);
-    return gaze;
+    if(!(_cached & CACHED_GAZE)){
+      // this will fail miserably if gaze is a zero length vector.
+      _gaze = glm::normalize(lookAt - eyePosition);
+      _cached |= CACHED_GAZE;
+    }
+    return _gaze;
   }
 
   glm::vec3 right( ){
-    glm::vec3 r = glm::cross(gaze( ), upVector);
-    return r / glm::length(r);
+    if(!(_cached & CACHED_RIGHT)){
+      glm::vec3 r = glm::cross(gaze( ), upVector);
+      _right = r / glm::length(r);
+      _cached |= CACHED_RIGHT;
+    }
+    return _right;
   }
 
   void forward( ){
     glm::vec3 g = gaze();
     glm::mat4 m = glm::translate(g * _rotationDelta);
     eyePosition = m * glm::vec4(eyePosition, 1);
+    touch( );
   }
 
   void backward( ){
     glm::vec3 g = gaze();
     glm::mat4 m = glm::translate(g * -_rotationDelta);
     eyePosition = m * glm::vec4(eyePosition, 1);
+    touch( );
   }
 
   void panLeft( ){
@@ -215,6 +276,7 @@ public:
     __lookAt = m * glm::vec4(__lookAt, 1.0);
     // Move everything back
     lookAt = __lookAt + eyePosition;
+    touch( );
   }
 
   void panRight( ){
@@ -225,6 +287,7 @@ public:
     __lookAt = m * glm::vec4(__lookAt, 1.0);
     // Move everything back
     lookAt = __lookAt + eyePosition;
+    touch( );
   }
 
   void rotateCameraLeft( ){
@@ -234,6 +297,7 @@ public:
     glm::vec3 u = glm::cross(s, f);
     glm::mat3 m = glm::rotate(_rotationDelta, u);
     eyePosition = m * eyePosition;
+    touch( );
   }
 
   void rotateCameraRight( ){
@@ -243,6 +307,7 @@ public:
     glm::vec3 u = glm::cross(s, f);
     glm::mat3 m = glm::rotate(-_rotationDelta, u);
     eyePosition = m * eyePosition;
+    touch( );
   }
 
   void rotateCameraUp( ){
@@ -257,6 +322,7 @@ public:
     */
     upVector = m * upVector;
     eyePosition = m * eyePosition;
+    touch( );
   }
 
   void rotateCameraDown( ){
@@ -267,14 +333,42 @@ public:
     glm::mat3 m = glm::rotate(_rotationDelta, s);
     upVector = m * u;
     eyePosition = m * eyePosition;
+    touch( );
   }
 
   void perspectiveMatrix(glm::mat4& m, float windowAspectRatio){
-    m = glm::perspective(deg2rad(fovy), windowAspectRatio, near, far);
+    m = projectionMatrix(windowAspectRatio);
   }
 
   void lookAtMatrix(glm::mat4& m){
-    m = glm::lookAt(eyePosition, lookAt, upVector);
+    m = viewMatrix( );
+  }
+
+  const glm::mat4& projectionMatrix(float windowAspectRatio){
+    setAspect(windowAspectRatio);
+    if(!(_cached & CACHED_PROJECTION)){
+      _projection = glm::perspective(deg2rad(fovy), windowAspectRatio, near, far);
+      _cached |= CACHED_PROJECTION;
+    }
+    return _projection;
+  }
+
+  const glm::mat4& viewMatrix( ){
+    if(!(_cached & CACHED_VIEW)){
+      _view = glm::lookAt(eyePosition, lookAt, upVector);
+      _cached |= CACHED_VIEW;
+    }
+    return _view;
+  }
+
+  // The planes of projectionMatrix * viewMatrix.
+  const Frustum& frustum(float windowAspectRatio){
+    setAspect(windowAspectRatio);
+    if(!(_cached & CACHED_FRUSTUM)){
+      _frustum.extract(projectionMatrix(windowAspectRatio) * viewMatrix( ));
+      _cached |= CACHED_FRUSTUM;
+    }
+    return _frustum;
   }
 
   void debug( ){
@@ -0,0 +1,88 @@
+// 
+// A view frustum made of six planes pulled out of a combined
+// projection * view matrix.
+//
+//
+
+#include <iostream>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/gtx/string_cast.hpp>
+
+#ifndef _FRUSTUM_H_
+#define _FRUSTUM_H_
+
+class Frustum{
+public:
+  typedef enum{
+    LEFT_PLANE = 0,
+    RIGHT_PLANE,
+    BOTTOM_PLANE,
+    TOP_PLANE,
+    NEAR_PLANE,
+    FAR_PLANE,
+    PLANE_COUNT
+  }plane_t;
+
+  typedef enum{
+    OUTSIDE = 0,
+    INTERSECTING,
+    INSIDE
+  }containment_t;
+
+  // (a, b, c, d) with a unit length normal pointing into the frustum;
+  // a point p is on the inside of a plane when dot(n, p) + d >= 0.
+  glm::vec4 planes[PLANE_COUNT];
+
+  Frustum( ){ }
+
+  Frustum(const glm::mat4& m){
+    extract(m);
+  }
+
+  // Gribb & Hartmann: each plane is the sum or difference of the
+  // fourth row of the matrix and one of the first three rows.
+  void extract(const glm::mat4& m){
+    glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+    glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+    glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+    glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+    planes[LEFT_PLANE] = row3 + row0;
+    planes[RIGHT_PLANE] = row3 - row0;
+    planes[BOTTOM_PLANE] = row3 + row1;
+    planes[TOP_PLANE] = row3 - row1;
+    planes[NEAR_PLANE] = row3 + row2;
+    planes[FAR_PLANE] = row3 - row2;
+    for(int i = 0; i < PLANE_COUNT; i++){
+      planes[i] /= glm::length(glm::vec3(planes[i]));
+    }
+  }
+
+  float distance(int plane, const glm::vec3& p) const{
+    return glm::dot(glm::vec3(planes[plane]), p) + planes[plane].w;
+  }
+
+  containment_t classifySphere(const glm::vec3& center, float radius) const{
+    containment_t result = INSIDE;
+    for(int i = 0; i < PLANE_COUNT; i++){
+      float d = distance(i, center);
+      if(d < -radius){
+        return OUTSIDE;
+      }else if(d < radius){
+        result = INTERSECTING;
+      }
+    }
+    return result;
+  }
+
+  void debug( ){
+    std::cerr << "Frustum" << std::endl;
+    for(int i = 0; i < PLANE_COUNT; i++){
+      std::cerr << "plane " << i << ": " << glm::to_string(planes[i]) << std::endl;
+    }
+  }
+
+};
+
+#endif
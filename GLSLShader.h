@@ -313,15 +313,23 @@ public:
   }
   
   bool activate( ){
+    return activate( true );
+  }
+
+  // Without checkErrors glGetError is left to the caller, it stalls
+  // the pipeline on some drivers.
+  bool activate( bool checkErrors ){
     activateUniforms( );
-    msglError( );
+    if( checkErrors ){
+      msglError( );
+    }
     glUseProgram( _object );
 #ifndef NOTEXTURE
     if(_texture){
       _texture->bind( );
     }
 #endif
-    return( !msglError( ) );
+    return( !checkErrors || !msglError( ) );
   }
   
   bool deactivate( ){
@@ -0,0 +1,256 @@
+//
+// A thin cache in front of the OpenGL calls made for every teapot:
+// binding the program, setting uniforms and the generic attribute
+// values. A call that would set what is already set is dropped and
+// counted.
+//
+// Uniform values are kept per program and location, so the cache
+// must see every uniform set while it is on; invalidate( ) forgets
+// everything, as after linking or changes made behind its back.
+//
+// The error policy decides when glGetError is called: every time the
+// program is bound, as GLSLProgram::activate( ) does, once per frame
+// from endFrame( ), or never. Either way endFrame( ) reports whether
+// the frame had errors.
+//
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <GL/glew.h>
+
+#ifndef _GL_STATE_CACHE_H_
+#define _GL_STATE_CACHE_H_
+
+class GLStateCache{
+public:
+  typedef enum{
+    CHECK_ERRORS_ON_BIND,
+    CHECK_ERRORS_PER_FRAME,
+    CHECK_ERRORS_NEVER
+  }errorcheck_t;
+
+  // The cache the teapots' drawing code shares.
+  static GLStateCache& shared( ){
+    static GLStateCache cache;
+    return cache;
+  }
+
+  GLStateCache( ): _enabled(true), _errorCheck(CHECK_ERRORS_PER_FRAME), _failed(false), _program(0), _values(NULL), _issued(0), _dropped(0), _lastIssued(0), _lastDropped(0){ }
+
+  // Off, every call goes through and nothing is dropped.
+  void enable(bool on){
+    _enabled = on;
+    invalidate( );
+  }
+
+  bool isEnabled( ) const{
+    return _enabled;
+  }
+
+  void setErrorCheck(errorcheck_t policy){
+    _errorCheck = policy;
+  }
+
+  errorcheck_t errorCheck( ) const{
+    return _errorCheck;
+  }
+
+  static const char* errorCheckName(errorcheck_t policy){
+    switch(policy){
+    case CHECK_ERRORS_ON_BIND:
+      return "on every bind";
+    case CHECK_ERRORS_PER_FRAME:
+      return "once a frame";
+    default:
+      return "never";
+    }
+  }
+
+  void invalidate( ){
+    _program = 0;
+    _values = NULL;
+    _uniforms.clear( );
+    _attributes.clear( );
+  }
+
+  // Start counting the calls of a new frame.
+  void beginFrame( ){
+    _lastIssued = _issued;
+    _lastDropped = _dropped;
+    _issued = _dropped = 0;
+  }
+
+  // Check for the frame's errors if that is the policy; false if
+  // there were any, here or when binding a program.
+  bool endFrame( ){
+    bool failed = _failed;
+    _failed = false;
+    if(_errorCheck == CHECK_ERRORS_PER_FRAME){
+      failed = checkErrors("frame") || failed;
+    }
+    return !failed;
+  }
+
+  // Calls made and dropped during the last whole frame.
+  size_t issuedCalls( ) const{
+    return _lastIssued;
+  }
+
+  size_t droppedCalls( ) const{
+    return _lastDropped;
+  }
+
+  // Bind program, any class with id( ) and activate(bool checkErrors)
+  // such as GLSLProgram, unless it is bound already. False on errors.
+  template<typename Program>
+  bool use(Program& program){
+    GLuint id = program.id( );
+    if(_enabled && id == _program){
+      _dropped++;
+      return true;
+    }
+    _issued++;
+    _program = id;
+    _values = &_uniforms[id];
+    bool ok = program.activate(_errorCheck == CHECK_ERRORS_ON_BIND);
+    _failed = _failed || !ok;
+    return ok;
+  }
+
+  void uniform1i(GLint location, GLint v){
+    if(changed(location, &v, sizeof(v))){
+      glUniform1i(location, v);
+    }
+  }
+
+  void uniform1f(GLint location, GLfloat v){
+    if(changed(location, &v, sizeof(v))){
+      glUniform1f(location, v);
+    }
+  }
+
+  void uniform2f(GLint location, GLfloat x, GLfloat y){
+    GLfloat v[2] = {x, y};
+    if(changed(location, v, sizeof(v))){
+      glUniform2f(location, x, y);
+    }
+  }
+
+  void uniform3fv(GLint location, const GLfloat* v){
+    if(changed(location, v, 3 * sizeof(GLfloat))){
+      glUniform3fv(location, 1, v);
+    }
+  }
+
+  void uniform4fv(GLint location, const GLfloat* v){
+    if(changed(location, v, 4 * sizeof(GLfloat))){
+      glUniform4fv(location, 1, v);
+    }
+  }
+
+  void uniformMatrix4fv(GLint location, const GLfloat* m){
+    if(changed(location, m, 16 * sizeof(GLfloat))){
+      glUniformMatrix4fv(location, 1, GL_FALSE, m);
+    }
+  }
+
+  // The current value of generic attribute index, used while its
+  // array is off.
+  void vertexAttrib1f(GLuint index, GLfloat v){
+    if(index >= _attributes.size( )){
+      _attributes.resize(index + 1, Attribute( ));
+    }
+    Attribute& a = _attributes[index];
+    if(_enabled && a.valid && a.value == v){
+      _dropped++;
+      return;
+    }
+    _issued++;
+    a.valid = true;
+    a.value = v;
+    glVertexAttrib1f(index, v);
+  }
+
+  // Drawing from an enabled array leaves the attribute's current value
+  // undefined.
+  void forgetVertexAttrib(GLuint index){
+    if(index < _attributes.size( )){
+      _attributes[index].valid = false;
+    }
+  }
+
+  // Print and clear the pending OpenGL errors; true if there were any.
+  static bool checkErrors(const char* where){
+    bool found = false;
+    for(GLenum error = glGetError( ); error != GL_NO_ERROR; error = glGetError( )){
+      fprintf(stderr, "OpenGL error 0x%04x (%s).\n", error, where);
+      found = true;
+    }
+    return found;
+  }
+
+private:
+  // Room for the largest value cached, a 4 x 4 matrix.
+  class Uniform{
+  public:
+    bool valid;
+    unsigned char bytes[16 * sizeof(GLfloat)];
+
+    Uniform( ): valid(false){ }
+  };
+
+  class Attribute{
+  public:
+    bool valid;
+    GLfloat value;
+
+    Attribute( ): valid(false), value(0.0f){ }
+  };
+
+  bool _enabled;
+  errorcheck_t _errorCheck;
+  // Whether a bind of this frame failed.
+  bool _failed;
+  GLuint _program;
+  // The values of the bound program's uniforms, by location.
+  std::vector<Uniform>* _values;
+  std::map<GLuint, std::vector<Uniform> > _uniforms;
+  std::vector<Attribute> _attributes;
+  size_t _issued;
+  size_t _dropped;
+  size_t _lastIssued;
+  size_t _lastDropped;
+
+  // Whether location of the bound program must be set to the bytes
+  // at value, remembering them if so. Setting location -1, a uniform
+  // the program does not use, would do nothing and is not counted.
+  bool changed(GLint location, const void* value, size_t bytes){
+    if(location < 0){
+      return false;
+    }
+    if(!_enabled || !_values){
+      _issued++;
+      return true;
+    }
+    if(size_t(location) >= _values->size( )){
+      _values->resize(location + 1, Uniform( ));
+    }
+    Uniform& u = (*_values)[location];
+    if(u.valid && memcmp(u.bytes, value, bytes) == 0){
+      _dropped++;
+      return false;
+    }
+    u.valid = true;
+    memcpy(u.bytes, value, bytes);
+    _issued++;
+    return true;
+  }
+
+  GLStateCache(const GLStateCache&);
+  GLStateCache& operator=(const GLStateCache&);
+};
+
+#endif
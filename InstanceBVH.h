@@ -0,0 +1,290 @@
+//
+// A bounding volume hierarchy of axis aligned boxes over the
+// bounding spheres in an InstanceStore, culled against a Frustum.
+//
+// Traversal carries a bitmask of the planes that still have to be
+// tested. A box entirely on the inner side of a plane drops that
+// plane for its whole subtree, and once no planes are left the
+// subtree is accepted without looking at it any further.
+//
+// The parallel cull hands the subtrees a few levels below the root
+// to a JobSystem, each traversed by one job. Their instances share
+// words of the visibility masks, so the jobs set the bits atomically.
+//
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+#include <glm/vec3.hpp>
+#include <glm/common.hpp>
+
+#include "Frustum.h"
+#include "InstanceStore.h"
+#include "JobSystem.h"
+
+#ifndef _INSTANCE_BVH_H_
+#define _INSTANCE_BVH_H_
+
+class InstanceBVH{
+public:
+  struct Node{
+    glm::vec3 lo;
+    glm::vec3 hi;
+    // The instances below this node are order[first, first + count).
+    uint32_t first;
+    uint32_t count;
+    // Index of the first of two adjacent children; 0 for a leaf.
+    uint32_t left;
+  };
+
+  // Node 0 is the root. Children always follow their parent.
+  std::vector<Node> nodes;
+  // Instance indices, grouped so every subtree is a contiguous range.
+  std::vector<uint32_t> order;
+
+  // Statistics of the last cull.
+  size_t nodesVisited;
+  size_t spheresTested;
+
+  InstanceBVH(uint32_t leafSize = 16): nodesVisited(0), spheresTested(0), _leafSize(leafSize){ }
+
+  bool empty( ) const{
+    return nodes.empty( );
+  }
+
+  // Build the tree from scratch over the current instances.
+  void build(const InstanceStore& instances){
+    nodes.clear( );
+    order.resize(instances.size( ));
+    for(size_t i = 0; i < order.size( ); i++){
+      order[i] = uint32_t(i);
+    }
+    if(order.empty( )){
+      return;
+    }
+    nodes.reserve(2 * (order.size( ) / _leafSize + 1));
+    Node root;
+    root.first = 0;
+    root.count = uint32_t(order.size( ));
+    root.left = 0;
+    nodes.push_back(root);
+    split(instances, 0);
+    refit(instances);
+  }
+
+  // Recompute every box in place after instances moved, keeping the
+  // topology. Cheaper than build() but the tree degrades as
+  // instances drift away from where they were when it was built.
+  void refit(const InstanceStore& instances){
+    for(size_t n = nodes.size( ); n-- > 0; ){
+      Node& node = nodes[n];
+      if(node.left == 0){
+        uint32_t i = order[node.first];
+        node.lo = instances.center(i) - instances.r[i];
+        node.hi = instances.center(i) + instances.r[i];
+        for(uint32_t k = node.first + 1; k < node.first + node.count; k++){
+          i = order[k];
+          node.lo = glm::min(node.lo, instances.center(i) - instances.r[i]);
+          node.hi = glm::max(node.hi, instances.center(i) + instances.r[i]);
+        }
+      }else{
+        node.lo = glm::min(nodes[node.left].lo, nodes[node.left + 1].lo);
+        node.hi = glm::max(nodes[node.left].hi, nodes[node.left + 1].hi);
+      }
+    }
+  }
+
+  // Write the visible and inside bits of every instance.
+  void cull(const Frustum& frustum, InstanceStore& instances){
+    instances.clearMasks( );
+    nodesVisited = 0;
+    spheresTested = 0;
+    if(nodes.empty( )){
+      return;
+    }
+    _stacks.resize(1);
+    traverse(frustum, instances, 0, _stacks[0], nodesVisited, spheresTested, false);
+  }
+
+  // The same on every worker of jobs, a subtree per job.
+  void cull(const Frustum& frustum, InstanceStore& instances, JobSystem& jobs){
+    instances.clearMasks( );
+    nodesVisited = 0;
+    spheresTested = 0;
+    if(nodes.empty( )){
+      return;
+    }
+    // split the tree until there are a few subtrees per worker
+    unsigned int workers = jobs.workerCount( );
+    _roots.assign(1, 0);
+    bool split = true;
+    while(split && _roots.size( ) < 4 * size_t(workers)){
+      split = false;
+      _next.clear( );
+      for(size_t k = 0; k < _roots.size( ); k++){
+        const Node& node = nodes[_roots[k]];
+        if(node.left == 0){
+          _next.push_back(_roots[k]);
+        }else{
+          _next.push_back(node.left);
+          _next.push_back(node.left + 1);
+          split = true;
+        }
+      }
+      _roots.swap(_next);
+    }
+    _stacks.resize(workers);
+    _visited.assign(workers, 0);
+    _tested.assign(workers, 0);
+    jobs.parallelFor(_roots.size( ), 1, [&](size_t begin, size_t end, unsigned int worker){
+      for(size_t k = begin; k < end; k++){
+        traverse(frustum, instances, _roots[k], _stacks[worker], _visited[worker], _tested[worker], true);
+      }
+    });
+    for(unsigned int w = 0; w < workers; w++){
+      nodesVisited += _visited[w];
+      spheresTested += _tested[w];
+    }
+  }
+
+private:
+  typedef std::vector<std::pair<uint32_t, uint32_t> > stack_t;
+
+  uint32_t _leafSize;
+  // A traversal stack per worker.
+  std::vector<stack_t> _stacks;
+  // The subtrees of the parallel cull, and its statistics per worker.
+  std::vector<uint32_t> _roots;
+  std::vector<uint32_t> _next;
+  std::vector<size_t> _visited;
+  std::vector<size_t> _tested;
+
+  // Cull the subtree under root with all planes, marking the masks
+  // atomically when shared.
+  void traverse(const Frustum& frustum, InstanceStore& instances, uint32_t root, stack_t& stack, size_t& visited, size_t& tested, bool shared){
+    const uint32_t allPlanes = (1 << Frustum::PLANE_COUNT) - 1;
+    stack.clear( );
+    stack.push_back(std::make_pair(root, allPlanes));
+    while(!stack.empty( )){
+      uint32_t n = stack.back( ).first;
+      uint32_t planeMask = stack.back( ).second;
+      stack.pop_back( );
+      const Node& node = nodes[n];
+      visited++;
+      if(!classifyBox(frustum, node.lo, node.hi, planeMask)){
+        continue;
+      }
+      if(planeMask == 0){
+        acceptRange(instances, node.first, node.count, shared);
+      }else if(node.left == 0){
+        tested += node.count;
+        cullLeaf(frustum, instances, node, planeMask, shared);
+      }else{
+        stack.push_back(std::make_pair(node.left + 1, planeMask));
+        stack.push_back(std::make_pair(node.left, planeMask));
+      }
+    }
+  }
+
+  void mark(InstanceStore& instances, uint32_t i, Frustum::containment_t c, bool shared){
+    if(shared){
+      instances.markContainment(i, c);
+    }else{
+      instances.setContainment(i, c);
+    }
+  }
+
+  // Median split on the longest axis of the sphere centers.
+  void split(const InstanceStore& instances, uint32_t n){
+    uint32_t first = nodes[n].first;
+    uint32_t count = nodes[n].count;
+    if(count <= _leafSize){
+      return;
+    }
+    glm::vec3 lo = instances.center(order[first]);
+    glm::vec3 hi = lo;
+    for(uint32_t k = first + 1; k < first + count; k++){
+      lo = glm::min(lo, instances.center(order[k]));
+      hi = glm::max(hi, instances.center(order[k]));
+    }
+    glm::vec3 extent = hi - lo;
+    int axis = 0;
+    if(extent.y > extent[axis]){
+      axis = 1;
+    }
+    if(extent.z > extent[axis]){
+      axis = 2;
+    }
+    const std::vector<float>& key = (axis == 0) ? instances.x : ((axis == 1) ? instances.y : instances.z);
+    uint32_t half = count / 2;
+    std::nth_element(order.begin( ) + first, order.begin( ) + first + half, order.begin( ) + first + count,
+                     [&key](uint32_t a, uint32_t b){ return key[a] < key[b]; });
+    Node left;
+    left.first = first;
+    left.count = half;
+    left.left = 0;
+    Node right;
+    right.first = first + half;
+    right.count = count - half;
+    right.left = 0;
+    nodes[n].left = uint32_t(nodes.size( ));
+    nodes.push_back(left);
+    nodes.push_back(right);
+    split(instances, nodes[n].left);
+    split(instances, nodes[n].left + 1);
+  }
+
+  // Returns false if the box is outside one of the planes in
+  // planeMask, and clears the bits of planes it is fully inside.
+  static bool classifyBox(const Frustum& frustum, const glm::vec3& lo, const glm::vec3& hi, uint32_t& planeMask){
+    for(int p = 0; p < Frustum::PLANE_COUNT; p++){
+      if(!(planeMask & (1 << p))){
+        continue;
+      }
+      const glm::vec4& plane = frustum.planes[p];
+      // the corners farthest along and against the plane normal
+      glm::vec3 positive(plane.x >= 0 ? hi.x : lo.x, plane.y >= 0 ? hi.y : lo.y, plane.z >= 0 ? hi.z : lo.z);
+      glm::vec3 negative(plane.x >= 0 ? lo.x : hi.x, plane.y >= 0 ? lo.y : hi.y, plane.z >= 0 ? lo.z : hi.z);
+      if(frustum.distance(p, positive) < 0){
+        return false;
+      }
+      if(frustum.distance(p, negative) >= 0){
+        planeMask &= ~(1 << p);
+      }
+    }
+    return true;
+  }
+
+  void acceptRange(InstanceStore& instances, uint32_t first, uint32_t count, bool shared){
+    for(uint32_t k = first; k < first + count; k++){
+      mark(instances, order[k], Frustum::INSIDE, shared);
+    }
+  }
+
+  void cullLeaf(const Frustum& frustum, InstanceStore& instances, const Node& node, uint32_t planeMask, bool shared){
+    for(uint32_t k = node.first; k < node.first + node.count; k++){
+      uint32_t i = order[k];
+      glm::vec3 c = instances.center(i);
+      float r = instances.r[i];
+      Frustum::containment_t result = Frustum::INSIDE;
+      for(int p = 0; p < Frustum::PLANE_COUNT; p++){
+        if(!(planeMask & (1 << p))){
+          continue;
+        }
+        float d = frustum.distance(p, c);
+        if(d < -r){
+          result = Frustum::OUTSIDE;
+          break;
+        }else if(d < r){
+          result = Frustum::INTERSECTING;
+        }
+      }
+      if(result != Frustum::OUTSIDE){
+        mark(instances, i, result, shared);
+      }
+    }
+  }
+
+};
+
+#endif
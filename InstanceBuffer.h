@@ -0,0 +1,142 @@
+//
+// Per-instance attributes of the teapots drawn with instanced draws,
+// written every frame into a StreamBuffer's region for the frame,
+// persistently mapped where the driver allows.
+//
+// While bound, the instancePosition and instanceMaterial attributes
+// advance once per instance from a given instance on, and the
+// shader's instanced uniform is set: blinn_phong.vert.glsl scales and
+// moves each instance's vertices into world coordinates, so the
+// modelview matrix is the view matrix alone, and the fragment shader
+// takes the instance's material from the MaterialTable. Teapots drawn
+// one at a time set instanceMaterial with material( ) instead.
+//
+
+#include <stdint.h>
+
+#include <GL/glew.h>
+
+#include "GLStateCache.h"
+#include "StreamBuffer.h"
+
+#ifndef _INSTANCE_BUFFER_H_
+#define _INSTANCE_BUFFER_H_
+
+// The attributes of one instance: its position and scale, then the
+// MaterialTable index of its material, which reaches the shader as a
+// float.
+class TeapotInstance{
+public:
+  float position[3];
+  float scale;
+  uint16_t material;
+  uint16_t pad;
+};
+
+class InstanceBuffer{
+public:
+  // Generic attributes to bind instancePosition and instanceMaterial
+  // to before the program links.
+  static const GLuint POSITION_ATTRIBUTE = 8;
+  static const GLuint MATERIAL_ATTRIBUTE = 9;
+
+  InstanceBuffer( ): _offset(0), _count(0){ }
+
+  ~InstanceBuffer( ){
+    release( );
+  }
+
+  // Instanced draws and attributes stepping per instance need
+  // ARB_draw_instanced and ARB_instanced_arrays.
+  static bool isSupported( ){
+    return GLEW_ARB_draw_instanced && GLEW_ARB_instanced_arrays;
+  }
+
+  // Where the shader's instanced uniform is, once it links.
+  static void setInstancedUniform(GLint location){
+    instancedUniform( ) = location;
+  }
+
+  // The frames' regions; begin and end each frame with it.
+  StreamBuffer& stream( ){
+    return _stream;
+  }
+
+  // Make room for count instances a frame from the next frame on.
+  void reserve(size_t count){
+    _stream.reserve(count * sizeof(TeapotInstance));
+  }
+
+  // Room for this frame's count instances, to be filled, from any
+  // thread, before unmap( ). Once a frame; NULL if they do not fit, in
+  // which case the stream grows at the start of the next frame.
+  TeapotInstance* map(size_t count){
+    // starting a cache line
+    TeapotInstance* instances = (TeapotInstance*)_stream.allocate(count * sizeof(TeapotInstance), 64, _offset);
+    _count = instances ? count : 0;
+    if(!instances){
+      _stream.reserve(count * sizeof(TeapotInstance));
+    }
+    return instances;
+  }
+
+  void unmap( ){
+    _stream.flush(_offset, _count * sizeof(TeapotInstance));
+  }
+
+  void release( ){
+    _stream.release( );
+    _offset = 0;
+    _count = 0;
+  }
+
+  size_t size( ) const{
+    return _count;
+  }
+
+  // Make instance first the first one the next instanced draws see.
+  void bind(size_t first) const{
+    const GLvoid* at = (const GLvoid*)(_offset + first * sizeof(TeapotInstance));
+    glBindBuffer(GL_ARRAY_BUFFER, _stream.id( ));
+    glEnableVertexAttribArray(POSITION_ATTRIBUTE);
+    glEnableVertexAttribArray(MATERIAL_ATTRIBUTE);
+    glVertexAttribPointer(POSITION_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, sizeof(TeapotInstance), at);
+    glVertexAttribPointer(MATERIAL_ATTRIBUTE, 1, GL_UNSIGNED_SHORT, GL_FALSE, sizeof(TeapotInstance), (const GLvoid*)((const char*)at + 4 * sizeof(float)));
+    glVertexAttribDivisorARB(POSITION_ATTRIBUTE, 1);
+    glVertexAttribDivisorARB(MATERIAL_ATTRIBUTE, 1);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    GLStateCache::shared( ).uniform1i(instancedUniform( ), 1);
+  }
+
+  // The material of what is drawn next without instances: the value
+  // instanceMaterial keeps while its array is off.
+  static void material(uint16_t index){
+    GLStateCache::shared( ).vertexAttrib1f(MATERIAL_ATTRIBUTE, float(index));
+  }
+
+  void unbind( ) const{
+    GLStateCache& state = GLStateCache::shared( );
+    state.uniform1i(instancedUniform( ), 0);
+    glVertexAttribDivisorARB(POSITION_ATTRIBUTE, 0);
+    glVertexAttribDivisorARB(MATERIAL_ATTRIBUTE, 0);
+    glDisableVertexAttribArray(POSITION_ATTRIBUTE);
+    glDisableVertexAttribArray(MATERIAL_ATTRIBUTE);
+    state.forgetVertexAttrib(MATERIAL_ATTRIBUTE);
+  }
+
+private:
+  StreamBuffer _stream;
+  // Where this frame's instances start in the stream's buffer.
+  size_t _offset;
+  size_t _count;
+
+  static GLint& instancedUniform( ){
+    static GLint location = -1;
+    return location;
+  }
+
+  InstanceBuffer(const InstanceBuffer&);
+  InstanceBuffer& operator=(const InstanceBuffer&);
+};
+
+#endif
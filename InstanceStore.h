@@ -0,0 +1,152 @@
+//
+// Structure of arrays storage for teapot instance bounding spheres
+// and the visibility bits the culling kernels write.
+//
+//
+
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+#include <glm/vec3.hpp>
+
+#include "Frustum.h"
+#include "frustum_cull.h"
+
+#ifndef _INSTANCE_STORE_H_
+#define _INSTANCE_STORE_H_
+
+class InstanceStore{
+public:
+  // Bounding sphere centers and radii, one entry per instance.
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> z;
+  std::vector<float> r;
+  // One bit per instance, 32 instances per word. An instance is
+  // visible when its sphere is not outside any plane and inside
+  // when it is on the inner side of all six planes.
+  std::vector<uint32_t> visibleMask;
+  std::vector<uint32_t> insideMask;
+  // The plane that last rejected each instance; tested first next time.
+  std::vector<uint8_t> lastPlane;
+  // The level of detail band picked for each visible instance.
+  std::vector<uint8_t> lod;
+  // Indices of the visible instances, in increasing order; only the
+  // first visibleCount entries are valid.
+  std::vector<uint32_t> visibleList;
+  size_t visibleCount;
+
+  InstanceStore( ): visibleCount(0){ }
+
+  size_t size( ) const{
+    return x.size( );
+  }
+
+  size_t maskWords( ) const{
+    return visibleMask.size( );
+  }
+
+  void clear( ){
+    x.clear( );
+    y.clear( );
+    z.clear( );
+    r.clear( );
+    lastPlane.clear( );
+    lod.clear( );
+    visibleMask.clear( );
+    insideMask.clear( );
+    visibleList.clear( );
+    visibleCount = 0;
+  }
+
+  void reserve(size_t n){
+    x.reserve(n);
+    y.reserve(n);
+    z.reserve(n);
+    r.reserve(n);
+    lastPlane.reserve(n);
+    lod.reserve(n);
+  }
+
+  size_t add(const glm::vec3& center, float radius){
+    x.push_back(center.x);
+    y.push_back(center.y);
+    z.push_back(center.z);
+    r.push_back(radius);
+    lastPlane.push_back(0);
+    lod.push_back(0);
+    size_t words = (size( ) + 31) / 32;
+    visibleMask.resize(words, 0);
+    insideMask.resize(words, 0);
+    return size( ) - 1;
+  }
+
+  void set(size_t i, const glm::vec3& center, float radius){
+    x[i] = center.x;
+    y[i] = center.y;
+    z[i] = center.z;
+    r[i] = radius;
+  }
+
+  glm::vec3 center(size_t i) const{
+    return glm::vec3(x[i], y[i], z[i]);
+  }
+
+  void clearMasks( ){
+    memset(&visibleMask[0], 0, visibleMask.size( ) * sizeof(uint32_t));
+    memset(&insideMask[0], 0, insideMask.size( ) * sizeof(uint32_t));
+  }
+
+  // Gather the visible bits into visibleList after a cull.
+  size_t compact( ){
+    visibleList.resize(size( ));
+    visibleCount = size( ) ? compactVisible(&visibleMask[0], size( ), &visibleList[0]) : 0;
+    return visibleCount;
+  }
+
+  bool isVisible(size_t i) const{
+    return (visibleMask[i >> 5] >> (i & 31)) & 1;
+  }
+
+  bool isInside(size_t i) const{
+    return (insideMask[i >> 5] >> (i & 31)) & 1;
+  }
+
+  void setContainment(size_t i, Frustum::containment_t c){
+    uint32_t bit = uint32_t(1) << (i & 31);
+    if(c != Frustum::OUTSIDE){
+      visibleMask[i >> 5] |= bit;
+    }else{
+      visibleMask[i >> 5] &= ~bit;
+    }
+    if(c == Frustum::INSIDE){
+      insideMask[i >> 5] |= bit;
+    }else{
+      insideMask[i >> 5] &= ~bit;
+    }
+  }
+
+  // Like setContainment( ) right after clearMasks( ), but safe while
+  // other threads mark instances sharing the same words.
+  void markContainment(size_t i, Frustum::containment_t c){
+    uint32_t bit = uint32_t(1) << (i & 31);
+    if(c != Frustum::OUTSIDE){
+      __atomic_fetch_or(&visibleMask[i >> 5], bit, __ATOMIC_RELAXED);
+    }
+    if(c == Frustum::INSIDE){
+      __atomic_fetch_or(&insideMask[i >> 5], bit, __ATOMIC_RELAXED);
+    }
+  }
+
+  Frustum::containment_t containment(size_t i) const{
+    if(isInside(i)){
+      return Frustum::INSIDE;
+    }else if(isVisible(i)){
+      return Frustum::INTERSECTING;
+    }
+    return Frustum::OUTSIDE;
+  }
+
+};
+
+#endif
@@ -0,0 +1,168 @@
+//
+// A fixed pool of worker threads with one work stealing deque each.
+//
+// A worker takes jobs from the back of its own deque and, when that
+// runs dry, steals from the front of the others. The thread calling
+// parallelFor() is worker 0 and works along with the pool until its
+// jobs are done, so a pool of one thread runs everything inline.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef _JOB_SYSTEM_H_
+#define _JOB_SYSTEM_H_
+
+class JobSystem{
+public:
+  // fn(begin, end, worker) is called on [begin, end) of a range by the
+  // worker with the given index, in [0, workerCount( )).
+  typedef std::function<void(size_t, size_t, unsigned int)> rangefn_t;
+
+  // By default one worker per hardware thread.
+  JobSystem(unsigned int workers = 0): _deques(workers ? workers : std::max(1u, std::thread::hardware_concurrency( ))), _quit(false), _queued(0){
+    for(unsigned int i = 1; i < workerCount( ); i++){
+      _threads.push_back(std::thread(&JobSystem::workerLoop, this, i));
+    }
+  }
+
+  ~JobSystem( ){
+    {
+      std::lock_guard<std::mutex> lock(_sleepMutex);
+      _quit = true;
+    }
+    _wake.notify_all( );
+    for(size_t i = 0; i < _threads.size( ); i++){
+      _threads[i].join( );
+    }
+  }
+
+  unsigned int workerCount( ) const{
+    return unsigned(_deques.size( ));
+  }
+
+  // Split [0, count) into chunks of grain elements, run fn over all of
+  // them in parallel and return once every chunk is done.
+  void parallelFor(size_t count, size_t grain, const rangefn_t& fn){
+    if(count == 0){
+      return;
+    }
+    grain = std::max(grain, size_t(1));
+    Task task(fn);
+    size_t chunks = (count + grain - 1) / grain;
+    task.remaining = chunks;
+    {
+      std::lock_guard<std::mutex> lock(_sleepMutex);
+      _queued += chunks;
+    }
+    // deal the chunks out in contiguous runs, one run per worker
+    unsigned int workers = workerCount( );
+    for(unsigned int w = 0; w < workers; w++){
+      size_t first = chunks * w / workers;
+      size_t last = chunks * (w + 1) / workers;
+      std::lock_guard<std::mutex> lock(_deques[w].mutex);
+      for(size_t c = first; c < last; c++){
+        Job job;
+        job.task = &task;
+        job.begin = c * grain;
+        job.end = std::min(count, job.begin + grain);
+        _deques[w].jobs.push_back(job);
+      }
+    }
+    _wake.notify_all( );
+    while(task.remaining.load( ) > 0){
+      Job job;
+      if(take(0, job)){
+        run(job, 0);
+      }else{
+        std::this_thread::yield( );
+      }
+    }
+  }
+
+private:
+  struct Task{
+    const rangefn_t& fn;
+    std::atomic<size_t> remaining;
+    Task(const rangefn_t& f): fn(f), remaining(0){ }
+  };
+
+  struct Job{
+    Task* task;
+    size_t begin;
+    size_t end;
+  };
+
+  struct WorkDeque{
+    std::mutex mutex;
+    std::deque<Job> jobs;
+  };
+
+  std::vector<WorkDeque> _deques;
+  std::vector<std::thread> _threads;
+  std::mutex _sleepMutex;
+  std::condition_variable _wake;
+  bool _quit;
+  std::atomic<size_t> _queued;
+
+  bool popBack(unsigned int w, Job& job){
+    std::lock_guard<std::mutex> lock(_deques[w].mutex);
+    if(_deques[w].jobs.empty( )){
+      return false;
+    }
+    job = _deques[w].jobs.back( );
+    _deques[w].jobs.pop_back( );
+    return true;
+  }
+
+  bool stealFront(unsigned int w, Job& job){
+    std::lock_guard<std::mutex> lock(_deques[w].mutex);
+    if(_deques[w].jobs.empty( )){
+      return false;
+    }
+    job = _deques[w].jobs.front( );
+    _deques[w].jobs.pop_front( );
+    return true;
+  }
+
+  // Own deque first, then the others starting with the next worker.
+  bool take(unsigned int self, Job& job){
+    bool found = popBack(self, job);
+    for(unsigned int i = 1; !found && i < workerCount( ); i++){
+      found = stealFront((self + i) % workerCount( ), job);
+    }
+    if(found){
+      _queued--;
+    }
+    return found;
+  }
+
+  void run(Job& job, unsigned int worker){
+    job.task->fn(job.begin, job.end, worker);
+    job.task->remaining--;
+  }
+
+  void workerLoop(unsigned int self){
+    while(true){
+      Job job;
+      if(take(self, job)){
+        run(job, self);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(_sleepMutex);
+      _wake.wait(lock, [this]{ return _quit || _queued.load( ) > 0; });
+      if(_quit){
+        return;
+      }
+    }
+  }
+
+};
+
+#endif
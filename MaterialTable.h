@@ -0,0 +1,186 @@
+//
+// The scene's distinct materials, each stored once and referred to by
+// a 16 bit index, mirrored in a float texture the shaders read them
+// from.
+//
+// Material k takes TEXELS_PER_MATERIAL texels from texel
+// k * TEXELS_PER_MATERIAL on, rows of WIDTH texels: its ambient,
+// diffuse and specular colors, then its shininess.
+// blinn_phong.frag.glsl reads material instanceMaterial from it when
+// its useMaterialTable uniform is set, so drawing a teapot needs no
+// material uniforms. The texture is only written again by update( )
+// after materials were added or changed.
+//
+
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+#include <GL/glew.h>
+#include <glm/geometric.hpp>
+
+#include "GLStateCache.h"
+#include "Material.h"
+
+#ifndef _MATERIAL_TABLE_H_
+#define _MATERIAL_TABLE_H_
+
+class MaterialTable{
+public:
+  static const int TEXELS_PER_MATERIAL = 4;
+  static const int WIDTH = 1024;
+  // As many materials as a 16 bit index tells apart.
+  static const size_t CAPACITY = 65536;
+
+  MaterialTable( ): _texture(0), _height(0), _dirty(false), _uploads(0){ }
+
+  ~MaterialTable( ){
+    release( );
+  }
+
+  // Float textures come with ARB_texture_float.
+  static bool isSupported( ){
+    return GLEW_ARB_texture_float;
+  }
+
+  // The index of a material equal to m, added if there is none. Once
+  // the table is full the closest diffuse color stands in.
+  uint16_t add(const Material& m){
+    std::vector<float> k = key(m);
+    std::map<std::vector<float>, uint16_t>::const_iterator found = _index.find(k);
+    if(found != _index.end( )){
+      return found->second;
+    }
+    if(_materials.size( ) == CAPACITY){
+      return closest(m);
+    }
+    uint16_t index = uint16_t(_materials.size( ));
+    _materials.push_back(m);
+    _index[k] = index;
+    _dirty = true;
+    return index;
+  }
+
+  // Change material index to m; teapots referring to it change too.
+  void set(uint16_t index, const Material& m){
+    std::map<std::vector<float>, uint16_t>::iterator old = _index.find(key(_materials[index]));
+    if(old != _index.end( ) && old->second == index){
+      _index.erase(old);
+    }
+    _materials[index] = m;
+    _index[key(m)] = index;
+    _dirty = true;
+  }
+
+  const Material& material(uint16_t index) const{
+    return _materials[index];
+  }
+
+  size_t size( ) const{
+    return _materials.size( );
+  }
+
+  // How often the texture was written.
+  size_t uploadCount( ) const{
+    return _uploads;
+  }
+
+  // Write the materials to the texture if they changed since the last
+  // time, and tell whether it did. Needs a current OpenGL context.
+  bool update( ){
+    if(!_dirty){
+      return false;
+    }
+    _dirty = false;
+    _uploads++;
+    int height = int((_materials.size( ) * TEXELS_PER_MATERIAL + WIDTH - 1) / WIDTH);
+    std::vector<float> data(size_t(WIDTH) * height * 4, 0.0f);
+    for(size_t k = 0; k < _materials.size( ); k++){
+      float* texel = &data[k * TEXELS_PER_MATERIAL * 4];
+      const Material& m = _materials[k];
+      for(int c = 0; c < 4; c++){
+        texel[c] = m.ambient[c];
+        texel[4 + c] = m.diffuse[c];
+        texel[8 + c] = m.specular[c];
+      }
+      texel[12] = m.shininess;
+    }
+    if(!_texture){
+      glGenTextures(1, &_texture);
+      glBindTexture(GL_TEXTURE_2D, _texture);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }else{
+      glBindTexture(GL_TEXTURE_2D, _texture);
+    }
+    // grow the texture only when the rows run out
+    if(height > _height){
+      _height = height;
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, WIDTH, _height, 0, GL_RGBA, GL_FLOAT, &data[0]);
+    }else if(height > 0){
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, height, GL_RGBA, GL_FLOAT, &data[0]);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return true;
+  }
+
+  void release( ){
+    if(_texture){
+      glDeleteTextures(1, &_texture);
+      _texture = 0;
+    }
+    _height = 0;
+    _dirty = !_materials.empty( );
+  }
+
+  // Bind the table to texture unit unit and point the shader's
+  // materialTable sampler and materialTableSize uniforms at it.
+  void bind(GLint sampler, GLint size, int unit) const{
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, _texture);
+    glActiveTexture(GL_TEXTURE0);
+    GLStateCache& state = GLStateCache::shared( );
+    state.uniform1i(sampler, unit);
+    state.uniform2f(size, float(WIDTH), float(std::max(_height, 1)));
+  }
+
+private:
+  std::vector<Material> _materials;
+  std::map<std::vector<float>, uint16_t> _index;
+  GLuint _texture;
+  int _height;
+  bool _dirty;
+  size_t _uploads;
+
+  static std::vector<float> key(const Material& m){
+    std::vector<float> k(13);
+    for(int c = 0; c < 4; c++){
+      k[c] = m.ambient[c];
+      k[4 + c] = m.diffuse[c];
+      k[8 + c] = m.specular[c];
+    }
+    k[12] = m.shininess;
+    return k;
+  }
+
+  uint16_t closest(const Material& m) const{
+    uint16_t best = 0;
+    float distance = glm::distance(m.diffuse, _materials[0].diffuse);
+    for(size_t k = 1; k < _materials.size( ); k++){
+      float d = glm::distance(m.diffuse, _materials[k].diffuse);
+      if(d < distance){
+        distance = d;
+        best = uint16_t(k);
+      }
+    }
+    return best;
+  }
+
+  MaterialTable(const MaterialTable&);
+  MaterialTable& operator=(const MaterialTable&);
+};
+
+#endif
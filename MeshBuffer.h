@@ -0,0 +1,275 @@
+//
+// An indexed triangle mesh kept in OpenGL buffer objects.
+//
+// Vertices are interleaved positions and normals and are fed to the
+// fixed function gl_Vertex and gl_Normal attributes the shaders read.
+//
+// Packed vertices instead hold 16 bit positions within the mesh's
+// bounds, still fed to gl_Vertex, and 16 bit octahedral normals fed
+// to the packedNormal attribute; packedOffset and packedScale
+// restore the positions. Each draw sets the shader's packedVertices
+// uniform to its buffer's format and leaves it so, and the
+// GLStateCache drops it while the format stays the same; vertices
+// drawn otherwise need unpackedVertices( ) first.
+//
+// A buffer can also hold an edge list for wireframes, pairs of vertex
+// indices drawn as GL_LINES: every edge of the mesh, then its feature
+// edges, each list drawn with a single call.
+//
+// mirror( ) sets the shader's mirror uniform, signs the positions and
+// normals of later draws are multiplied by, so one buffer can be
+// drawn reflected. Faces are not culled, so the winding a reflection
+// turns around is left as it is.
+//
+
+#include <vector>
+#include <stdint.h>
+
+#include <GL/glew.h>
+#include <glm/vec3.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "GLStateCache.h"
+
+#ifndef _MESH_BUFFER_H_
+#define _MESH_BUFFER_H_
+
+class MeshBuffer{
+public:
+  // The generic attribute packedNormal must be bound to before the
+  // program links; NVIDIA aliases no fixed function attribute to it.
+  static const GLuint PACKED_NORMAL_ATTRIBUTE = 7;
+
+  MeshBuffer( ): _vertexBuffer(0), _indexBuffer(0), _edgeBuffer(0), _edgeIndexCount(0), _featureIndexCount(0), _indexCount(0), _stride(0), _vertexBytes(0), _packed(false), _offset(0.0f), _scale(1.0f){ }
+
+  ~MeshBuffer( ){
+    release( );
+  }
+
+  // floatsPerVertex floats per vertex: a position, then a normal.
+  void upload(const std::vector<float>& vertices, int floatsPerVertex, const std::vector<uint32_t>& indices){
+    upload(&vertices[0], vertices.size( ) / floatsPerVertex, floatsPerVertex, &indices[0], indices.size( ));
+  }
+
+  // The same from plain arrays, such as a mapped MeshCache file.
+  void upload(const float* vertices, size_t vertexCount, int floatsPerVertex, const uint32_t* indices, size_t indexCount){
+    release( );
+    _stride = floatsPerVertex * sizeof(float);
+    _packed = false;
+    uploadVertices(vertices, vertexCount * _stride);
+    uploadIndices(indices, indexCount);
+  }
+
+  // shortsPerVertex values per vertex: three position values in
+  // [-32767, 32767] mapping offset - scale to offset + scale, then the
+  // two octahedral normal values.
+  void uploadPacked(const std::vector<int16_t>& vertices, int shortsPerVertex, const glm::vec3& offset, const glm::vec3& scale, const std::vector<uint32_t>& indices){
+    uploadPacked(&vertices[0], vertices.size( ) / shortsPerVertex, shortsPerVertex, offset, scale, &indices[0], indices.size( ));
+  }
+
+  void uploadPacked(const int16_t* vertices, size_t vertexCount, int shortsPerVertex, const glm::vec3& offset, const glm::vec3& scale, const uint32_t* indices, size_t indexCount){
+    release( );
+    _stride = shortsPerVertex * sizeof(int16_t);
+    _packed = true;
+    _offset = offset;
+    _scale = scale;
+    uploadVertices(vertices, vertexCount * _stride);
+    uploadIndices(indices, indexCount);
+  }
+
+  // Load edges and features, each count index pairs, after the
+  // vertices.
+  void uploadEdges(const uint32_t* edges, size_t edgeCount, const uint32_t* features, size_t featureCount){
+    if(_edgeBuffer){
+      glDeleteBuffers(1, &_edgeBuffer);
+    }
+    _edgeIndexCount = GLsizei(edgeCount);
+    _featureIndexCount = GLsizei(featureCount);
+    glGenBuffers(1, &_edgeBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _edgeBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (edgeCount + featureCount) * sizeof(uint32_t), NULL, GL_STATIC_DRAW);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, edgeCount * sizeof(uint32_t), edges);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, edgeCount * sizeof(uint32_t), featureCount * sizeof(uint32_t), features);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+
+  // Where the shader's packed vertex uniforms are, once it links.
+  static void setPackedUniforms(GLint packed, GLint offset, GLint scale){
+    packedUniforms( )[0] = packed;
+    packedUniforms( )[1] = offset;
+    packedUniforms( )[2] = scale;
+  }
+
+  // Let the shader take float vertices from gl_Vertex and gl_Normal,
+  // as immediate mode draws give them.
+  static void unpackedVertices( ){
+    GLStateCache::shared( ).uniform1i(packedUniforms( )[0], 0);
+  }
+
+  // Where the shader's mirror uniform is, once it links.
+  static void setMirrorUniform(GLint location){
+    mirrorUniform( ) = location;
+  }
+
+  // Reflect what is drawn next by the signs of the components of
+  // signs.
+  static void mirror(const glm::vec3& signs){
+    GLStateCache::shared( ).uniform3fv(mirrorUniform( ), glm::value_ptr(signs));
+  }
+
+  void release( ){
+    if(_vertexBuffer){
+      glDeleteBuffers(1, &_vertexBuffer);
+      _vertexBuffer = 0;
+    }
+    if(_indexBuffer){
+      glDeleteBuffers(1, &_indexBuffer);
+      _indexBuffer = 0;
+    }
+    if(_edgeBuffer){
+      glDeleteBuffers(1, &_edgeBuffer);
+      _edgeBuffer = 0;
+    }
+    _edgeIndexCount = _featureIndexCount = 0;
+    _indexCount = 0;
+    _vertexBytes = 0;
+  }
+
+  bool isLoaded( ) const{
+    return _indexCount > 0;
+  }
+
+  GLsizei indexCount( ) const{
+    return _indexCount;
+  }
+
+  size_t vertexBytes( ) const{
+    return _vertexBytes;
+  }
+
+  GLsizei edgeIndexCount(bool features) const{
+    return features ? _featureIndexCount : _edgeIndexCount;
+  }
+
+  void draw( ) const{
+    draw(_indexCount);
+  }
+
+  // Draw only the first count indices.
+  void draw(GLsizei count) const{
+    bind( );
+    glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, (const GLvoid*)0);
+    unbind( );
+  }
+
+  // Draw the first count indices once for each of instances
+  // instances, whose attributes an InstanceBuffer supplies.
+  void drawInstanced(GLsizei count, GLsizei instances) const{
+    bind( );
+    glDrawElementsInstancedARB(GL_TRIANGLES, count, GL_UNSIGNED_INT, (const GLvoid*)0, instances);
+    unbind( );
+  }
+
+  // The offset into the index buffer of index first.
+  static const GLvoid* indexOffset(uint32_t first){
+    return (const GLvoid*)(size_t(first) * sizeof(uint32_t));
+  }
+
+  // Draw only some runs of indices, counts[k] of them from offsets[k]
+  // on, with a single call.
+  void drawRanges(const std::vector<GLsizei>& counts, const std::vector<const GLvoid*>& offsets) const{
+    if(counts.empty( )){
+      return;
+    }
+    bind( );
+    glMultiDrawElements(GL_TRIANGLES, &counts[0], GL_UNSIGNED_INT, &offsets[0], GLsizei(counts.size( )));
+    unbind( );
+  }
+
+  // Draw the first count indices of the edges or the feature edges
+  // as lines.
+  void drawEdges(bool features, GLsizei count) const{
+    if(!_edgeBuffer){
+      return;
+    }
+    bind( );
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _edgeBuffer);
+    glDrawElements(GL_LINES, count, GL_UNSIGNED_INT, indexOffset(features ? _edgeIndexCount : 0));
+    unbind( );
+  }
+
+private:
+  GLuint _vertexBuffer;
+  GLuint _indexBuffer;
+  GLuint _edgeBuffer;
+  GLsizei _edgeIndexCount;
+  GLsizei _featureIndexCount;
+  GLsizei _indexCount;
+  GLsizei _stride;
+  size_t _vertexBytes;
+  bool _packed;
+  glm::vec3 _offset;
+  glm::vec3 _scale;
+
+  static GLint* packedUniforms( ){
+    static GLint locations[3] = {-1, -1, -1};
+    return locations;
+  }
+
+  static GLint& mirrorUniform( ){
+    static GLint location = -1;
+    return location;
+  }
+
+  void uploadVertices(const GLvoid* data, size_t bytes){
+    _vertexBytes = bytes;
+    glGenBuffers(1, &_vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, _vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, bytes, data, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  void uploadIndices(const uint32_t* indices, size_t indexCount){
+    _indexCount = GLsizei(indexCount);
+    glGenBuffers(1, &_indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(uint32_t), indices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+
+  void bind( ) const{
+    glBindBuffer(GL_ARRAY_BUFFER, _vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    const GLint* uniforms = packedUniforms( );
+    GLStateCache& state = GLStateCache::shared( );
+    state.uniform1i(uniforms[0], _packed ? 1 : 0);
+    if(_packed){
+      state.uniform3fv(uniforms[1], glm::value_ptr(_offset));
+      state.uniform3fv(uniforms[2], glm::value_ptr(_scale));
+      glEnableVertexAttribArray(PACKED_NORMAL_ATTRIBUTE);
+      glVertexPointer(3, GL_SHORT, _stride, (const GLvoid*)0);
+      glVertexAttribPointer(PACKED_NORMAL_ATTRIBUTE, 2, GL_SHORT, GL_FALSE, _stride, (const GLvoid*)(3 * sizeof(int16_t)));
+    }else{
+      glEnableClientState(GL_NORMAL_ARRAY);
+      glVertexPointer(3, GL_FLOAT, _stride, (const GLvoid*)0);
+      glNormalPointer(GL_FLOAT, _stride, (const GLvoid*)(3 * sizeof(float)));
+    }
+  }
+
+  void unbind( ) const{
+    if(_packed){
+      glDisableVertexAttribArray(PACKED_NORMAL_ATTRIBUTE);
+    }else{
+      glDisableClientState(GL_NORMAL_ARRAY);
+    }
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  MeshBuffer(const MeshBuffer&);
+  MeshBuffer& operator=(const MeshBuffer&);
+};
+
+#endif
@@ -0,0 +1,342 @@
+//
+// A binary file holding every level of a TeapotLodChain ready for
+// drawing, mapped into memory so its arrays go straight to the
+// buffer uploads.
+//
+// The file is a MeshCacheHeader, a MeshCacheLevel per level, then
+// for every level its float vertices, packed vertices, indices,
+// meshlets, edges and feature edges, each section starting on a
+// MESH_CACHE_ALIGNMENT byte boundary. The header carries a checksum
+// of everything after it and a key hashed from the teapot's control
+// points, the grids, whether they are adaptive and the layout of the
+// records; a file whose key, version, size or checksum does not match
+// is ignored and written anew.
+//
+// Bump MESH_CACHE_VERSION whenever tessellation, meshlet building or
+// mesh optimization change what they produce.
+//
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "glut_teapot.h"
+#include "Meshlet.h"
+#include "TeapotLod.h"
+#include "TeapotMesh.h"
+
+#ifndef _MESH_CACHE_H_
+#define _MESH_CACHE_H_
+
+static const uint32_t MESH_CACHE_VERSION = 6;
+static const size_t MESH_CACHE_ALIGNMENT = 64;
+
+class MeshCacheHeader{
+public:
+  char magic[8];
+  uint32_t version;
+  uint32_t levelCount;
+  uint64_t key;
+  uint64_t fileBytes;
+  // FNV-1a of bytes [sizeof(MeshCacheHeader), fileBytes)
+  uint64_t checksum;
+  uint64_t reserved[3];
+};
+
+// A level's numbers and where its sections start, in bytes from the
+// start of the file.
+class MeshCacheLevel{
+public:
+  int32_t grid;
+  float error;
+  float acmrBefore;
+  float atvrBefore;
+  float acmrAfter;
+  float atvrAfter;
+  uint64_t vertexCountBefore;
+  uint64_t vertexCount;
+  uint64_t indexCount;
+  uint64_t meshletCount;
+  uint64_t fourFoldIndexCount;
+  uint64_t fourFoldMeshletCount;
+  uint64_t drawnTriangles;
+  uint64_t edgeIndexCount;
+  uint64_t fourFoldEdgeIndexCount;
+  uint64_t featureIndexCount;
+  uint64_t fourFoldFeatureIndexCount;
+  float packedOffset[3];
+  float packedScale[3];
+  uint64_t verticesAt;
+  uint64_t packedAt;
+  uint64_t indicesAt;
+  uint64_t meshletsAt;
+  uint64_t edgesAt;
+  uint64_t featureEdgesAt;
+};
+
+class MeshCache{
+public:
+  MeshCache( ): _data(NULL), _bytes(0){ }
+
+  ~MeshCache( ){
+    close( );
+  }
+
+  // A key for the chain built from the count grids, adaptive or not,
+  // with the teapot's current control points.
+  static uint64_t key(const int* grids, int count, bool adaptive){
+    uint64_t hash = fnv1a(NULL, 0);
+    uint32_t layout[7] = {MESH_CACHE_VERSION, uint32_t(TeapotMesh::VERTEX_FLOATS), uint32_t(TeapotMesh::PACKED_VERTEX_SHORTS), uint32_t(sizeof(Meshlet)), uint32_t(sizeof(MeshCacheLevel)), uint32_t(count), uint32_t(adaptive)};
+    hash = fnv1a(layout, sizeof(layout), hash);
+    hash = fnv1a(grids, count * sizeof(int), hash);
+    for(int n = 0; n < _glutTeapotPatchCount( ); n++){
+      GLfloat cp[4][4][3];
+      _glutTeapotPatch(n, cp);
+      hash = fnv1a(cp, sizeof(cp), hash);
+    }
+    return hash;
+  }
+
+  // Map path if it is a valid cache with key. False if it is missing
+  // or stale.
+  bool open(const char* path, uint64_t key){
+    close( );
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0){
+      return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(MeshCacheHeader)){
+      ::close(fd);
+      return false;
+    }
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(data == MAP_FAILED){
+      return false;
+    }
+    _data = (const char*)data;
+    _bytes = info.st_size;
+    if(!isValid(key)){
+      close( );
+      return false;
+    }
+    return true;
+  }
+
+  void close( ){
+    if(_data){
+      munmap((void*)_data, _bytes);
+      _data = NULL;
+      _bytes = 0;
+    }
+  }
+
+  bool isOpen( ) const{
+    return _data != NULL;
+  }
+
+  int levelCount( ) const{
+    return int(header( ).levelCount);
+  }
+
+  const MeshCacheLevel& level(int k) const{
+    return ((const MeshCacheLevel*)(_data + sizeof(MeshCacheHeader)))[k];
+  }
+
+  const float* vertices(int k) const{
+    return (const float*)(_data + level(k).verticesAt);
+  }
+
+  const int16_t* packedVertices(int k) const{
+    return (const int16_t*)(_data + level(k).packedAt);
+  }
+
+  const uint32_t* indices(int k) const{
+    return (const uint32_t*)(_data + level(k).indicesAt);
+  }
+
+  const Meshlet* meshlets(int k) const{
+    return (const Meshlet*)(_data + level(k).meshletsAt);
+  }
+
+  const uint32_t* edges(int k) const{
+    return (const uint32_t*)(_data + level(k).edgesAt);
+  }
+
+  const uint32_t* featureEdges(int k) const{
+    return (const uint32_t*)(_data + level(k).featureEdgesAt);
+  }
+
+  // Give chain the errors and cache statistics of the levels, without
+  // their meshes.
+  void restore(TeapotLodChain& chain) const{
+    int count = levelCount( );
+    chain.levels.clear( );
+    chain.error.resize(count);
+    chain.triangles.resize(count);
+    chain.cacheBefore.resize(count);
+    chain.cacheAfter.resize(count);
+    for(int k = 0; k < count; k++){
+      const MeshCacheLevel& l = level(k);
+      chain.error[k] = l.error;
+      chain.triangles[k] = l.drawnTriangles;
+      chain.cacheBefore[k].acmr = l.acmrBefore;
+      chain.cacheBefore[k].atvr = l.atvrBefore;
+      chain.cacheBefore[k].vertexCount = l.vertexCountBefore;
+      chain.cacheAfter[k].acmr = l.acmrAfter;
+      chain.cacheAfter[k].atvr = l.atvrAfter;
+      chain.cacheAfter[k].vertexCount = l.vertexCount;
+    }
+  }
+
+  // Write chain to path with key. The file is written under another
+  // name and renamed into place, so processes starting at the same
+  // time never map a partial file.
+  static bool write(const char* path, uint64_t key, const TeapotLodChain& chain){
+    int count = int(chain.size( ));
+    std::vector<MeshCacheLevel> levels(count);
+    std::vector<std::vector<int16_t> > packed(count);
+    size_t at = align(sizeof(MeshCacheHeader) + count * sizeof(MeshCacheLevel));
+    for(int k = 0; k < count; k++){
+      const TeapotMesh& mesh = chain.levels[k];
+      MeshCacheLevel& l = levels[k];
+      memset(&l, 0, sizeof(l));
+      l.grid = mesh.grid;
+      l.error = chain.error[k];
+      l.acmrBefore = chain.cacheBefore[k].acmr;
+      l.atvrBefore = chain.cacheBefore[k].atvr;
+      l.vertexCountBefore = chain.cacheBefore[k].vertexCount;
+      l.acmrAfter = chain.cacheAfter[k].acmr;
+      l.atvrAfter = chain.cacheAfter[k].atvr;
+      l.vertexCount = mesh.vertexCount( );
+      l.indexCount = mesh.indices.size( );
+      l.meshletCount = mesh.meshlets.size( );
+      l.fourFoldIndexCount = mesh.fourFoldIndexCount;
+      l.fourFoldMeshletCount = mesh.fourFoldMeshletCount;
+      l.drawnTriangles = chain.triangles[k];
+      l.edgeIndexCount = mesh.edges.size( );
+      l.fourFoldEdgeIndexCount = mesh.fourFoldEdgeIndexCount;
+      l.featureIndexCount = mesh.featureEdges.size( );
+      l.fourFoldFeatureIndexCount = mesh.fourFoldFeatureIndexCount;
+      glm::vec3 offset, scale;
+      mesh.pack(packed[k], offset, scale);
+      for(int c = 0; c < 3; c++){
+        l.packedOffset[c] = offset[c];
+        l.packedScale[c] = scale[c];
+      }
+      l.verticesAt = at;
+      at = align(at + mesh.vertices.size( ) * sizeof(float));
+      l.packedAt = at;
+      at = align(at + packed[k].size( ) * sizeof(int16_t));
+      l.indicesAt = at;
+      at = align(at + mesh.indices.size( ) * sizeof(uint32_t));
+      l.meshletsAt = at;
+      at = align(at + mesh.meshlets.size( ) * sizeof(Meshlet));
+      l.edgesAt = at;
+      at = align(at + mesh.edges.size( ) * sizeof(uint32_t));
+      l.featureEdgesAt = at;
+      at = align(at + mesh.featureEdges.size( ) * sizeof(uint32_t));
+    }
+
+    std::vector<char> file(at, 0);
+    memcpy(&file[sizeof(MeshCacheHeader)], &levels[0], count * sizeof(MeshCacheLevel));
+    for(int k = 0; k < count; k++){
+      const TeapotMesh& mesh = chain.levels[k];
+      const MeshCacheLevel& l = levels[k];
+      memcpy(&file[l.verticesAt], &mesh.vertices[0], mesh.vertices.size( ) * sizeof(float));
+      memcpy(&file[l.packedAt], &packed[k][0], packed[k].size( ) * sizeof(int16_t));
+      memcpy(&file[l.indicesAt], &mesh.indices[0], mesh.indices.size( ) * sizeof(uint32_t));
+      if(!mesh.meshlets.empty( )){
+        memcpy(&file[l.meshletsAt], &mesh.meshlets[0], mesh.meshlets.size( ) * sizeof(Meshlet));
+      }
+      if(!mesh.edges.empty( )){
+        memcpy(&file[l.edgesAt], &mesh.edges[0], mesh.edges.size( ) * sizeof(uint32_t));
+      }
+      if(!mesh.featureEdges.empty( )){
+        memcpy(&file[l.featureEdgesAt], &mesh.featureEdges[0], mesh.featureEdges.size( ) * sizeof(uint32_t));
+      }
+    }
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "TEAPOTMC", 8);
+    header.version = MESH_CACHE_VERSION;
+    header.levelCount = count;
+    header.key = key;
+    header.fileBytes = at;
+    header.checksum = fnv1a(&file[sizeof(MeshCacheHeader)], at - sizeof(MeshCacheHeader));
+    memcpy(&file[0], &header, sizeof(header));
+
+    char temporary[1024];
+    snprintf(temporary, sizeof(temporary), "%s.%d", path, int(getpid( )));
+    FILE* out = fopen(temporary, "wb");
+    if(!out){
+      return false;
+    }
+    bool written = fwrite(&file[0], 1, file.size( ), out) == file.size( );
+    written = (fclose(out) == 0) && written;
+    if(!written || rename(temporary, path) != 0){
+      remove(temporary);
+      return false;
+    }
+    return true;
+  }
+
+private:
+  const char* _data;
+  size_t _bytes;
+
+  const MeshCacheHeader& header( ) const{
+    return *(const MeshCacheHeader*)_data;
+  }
+
+  bool isValid(uint64_t key) const{
+    const MeshCacheHeader& h = header( );
+    if(memcmp(h.magic, "TEAPOTMC", 8) != 0 || h.version != MESH_CACHE_VERSION || h.key != key || h.fileBytes != _bytes){
+      return false;
+    }
+    if(sizeof(MeshCacheHeader) + h.levelCount * sizeof(MeshCacheLevel) > _bytes){
+      return false;
+    }
+    if(fnv1a(_data + sizeof(MeshCacheHeader), _bytes - sizeof(MeshCacheHeader)) != h.checksum){
+      return false;
+    }
+    // every section lies within the file
+    for(int k = 0; k < levelCount( ); k++){
+      const MeshCacheLevel& l = level(k);
+      if(l.verticesAt + l.vertexCount * TeapotMesh::VERTEX_FLOATS * sizeof(float) > _bytes ||
+         l.packedAt + l.vertexCount * TeapotMesh::PACKED_VERTEX_SHORTS * sizeof(int16_t) > _bytes ||
+         l.indicesAt + l.indexCount * sizeof(uint32_t) > _bytes ||
+         l.meshletsAt + l.meshletCount * sizeof(Meshlet) > _bytes ||
+         l.edgesAt + l.edgeIndexCount * sizeof(uint32_t) > _bytes ||
+         l.featureEdgesAt + l.featureIndexCount * sizeof(uint32_t) > _bytes ||
+         l.fourFoldIndexCount > l.indexCount || l.fourFoldMeshletCount > l.meshletCount ||
+         l.fourFoldEdgeIndexCount > l.edgeIndexCount || l.fourFoldFeatureIndexCount > l.featureIndexCount){
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static size_t align(size_t at){
+    return (at + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+  }
+
+  static uint64_t fnv1a(const void* data, size_t bytes, uint64_t hash = 14695981039346656037ULL){
+    const unsigned char* p = (const unsigned char*)data;
+    for(size_t k = 0; k < bytes; k++){
+      hash = (hash ^ p[k]) * 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  MeshCache(const MeshCache&);
+  MeshCache& operator=(const MeshCache&);
+};
+
+#endif
@@ -0,0 +1,59 @@
+//
+// A small cluster of a mesh's triangles with the bounds used to skip
+// it before drawing: a bounding sphere and a cone around the normals
+// of its triangles.
+//
+//
+
+#include <cmath>
+#include <cstddef>
+#include <stdint.h>
+#include <glm/vec3.hpp>
+#include <glm/geometric.hpp>
+
+#ifndef _MESHLET_H_
+#define _MESHLET_H_
+
+class Meshlet{
+public:
+  // The meshlet's triangles are indices [firstIndex, firstIndex +
+  // indexCount) of the mesh's index array.
+  uint32_t firstIndex;
+  uint32_t indexCount;
+  glm::vec3 center;
+  float radius;
+  // Every triangle's normal is within the cone around coneAxis whose
+  // half angle has sine coneCutoff; 1 when the normals spread over a
+  // half space or more and the cone cannot reject anything.
+  glm::vec3 coneAxis;
+  float coneCutoff;
+
+  Meshlet( ): firstIndex(0), indexCount(0), center(0.0f), radius(0.0f), coneAxis(0.0f, 0.0f, 1.0f), coneCutoff(1.0f){ }
+
+  // True if every triangle faces away from eye, given in the mesh's
+  // coordinates, wherever it lies within the bounding sphere.
+  bool isBackFacing(const glm::vec3& eye) const{
+    glm::vec3 view = center - eye;
+    return glm::dot(view, coneAxis) >= coneCutoff * glm::length(view) + radius;
+  }
+
+};
+
+// Counts of meshlets drawn and skipped.
+class MeshletStats{
+public:
+  size_t drawn;
+  size_t backFacing;
+  size_t outside;
+
+  MeshletStats( ){
+    clear( );
+  }
+
+  void clear( ){
+    drawn = backFacing = outside = 0;
+  }
+
+};
+
+#endif
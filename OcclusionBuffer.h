@@ -0,0 +1,335 @@
+//
+// A small software depth buffer for occlusion culling on the CPU.
+//
+// A handful of large occluders are rasterized into a low resolution
+// buffer, then the screen space bounding rectangle and nearest depth
+// of each potentially visible object are compared against it. Depth is
+// window depth in [0, 1] and the buffer keeps the nearest occluder per
+// pixel. Pixels are stored in 8x4 tiles so a row of a tile is two SSE
+// registers and a rectangle query walks memory mostly in order.
+//
+// Once the occluders are in, buildPyramid() reduces the buffer into a
+// chain of levels, each holding the farthest depth of 2x2 texels of
+// the level below. A rectangle query then picks the level where the
+// rectangle spans at most 2x2 texels, so it costs the same whatever
+// the rectangle's size.
+//
+// Nothing here needs an OpenGL context.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef _OCCLUSION_BUFFER_H_
+#define _OCCLUSION_BUFFER_H_
+
+class OcclusionBuffer{
+public:
+  static const int TILE_WIDTH = 8;
+  static const int TILE_HEIGHT = 4;
+
+  // Statistics since the last clear().
+  int occludersDrawn;
+  int occludersSkipped;
+  int trianglesDrawn;
+
+  // width must be a multiple of 8 and height a multiple of 4.
+  OcclusionBuffer(int width = 256, int height = 128): _width(width), _height(height), _pyramidValid(false){
+    _depth.resize(_width * _height);
+    // levels 1 and up, down to a single row or column
+    for(int w = _width / 2, h = _height / 2; w >= 1 && h >= 1; w /= 2, h /= 2){
+      _levels.push_back(std::vector<float>(w * h));
+    }
+    clear( );
+  }
+
+  int width( ) const{
+    return _width;
+  }
+
+  int height( ) const{
+    return _height;
+  }
+
+  void setViewProjection(const glm::mat4& view, const glm::mat4& projection){
+    _view = view;
+    _projection = projection;
+    _viewProjection = projection * view;
+  }
+
+  void clear( ){
+    std::fill(_depth.begin( ), _depth.end( ), 1.0f);
+    occludersDrawn = 0;
+    occludersSkipped = 0;
+    trianglesDrawn = 0;
+    _pyramidValid = false;
+  }
+
+  int levelCount( ) const{
+    return int(_levels.size( )) + 1;
+  }
+
+  // Rebuild the max-depth levels from the buffer; call after drawing
+  // the occluders and before querying.
+  void buildPyramid( ){
+    if(_levels.empty( )){
+      return;
+    }
+    std::vector<float>& first = _levels[0];
+    int w = _width / 2;
+    for(int y = 0; y < _height / 2; y++){
+      for(int x = 0; x < w; x++){
+        float a = std::max(depth(2 * x, 2 * y), depth(2 * x + 1, 2 * y));
+        float b = std::max(depth(2 * x, 2 * y + 1), depth(2 * x + 1, 2 * y + 1));
+        first[y * w + x] = std::max(a, b);
+      }
+    }
+    for(size_t k = 1; k < _levels.size( ); k++){
+      const std::vector<float>& below = _levels[k - 1];
+      int bw = _width >> k;
+      int lw = _width >> (k + 1);
+      int lh = _height >> (k + 1);
+      for(int y = 0; y < lh; y++){
+        const float* row0 = &below[(2 * y) * bw];
+        const float* row1 = row0 + bw;
+        for(int x = 0; x < lw; x++){
+          float a = std::max(row0[2 * x], row0[2 * x + 1]);
+          float b = std::max(row1[2 * x], row1[2 * x + 1]);
+          _levels[k][y * lw + x] = std::max(a, b);
+        }
+      }
+    }
+    _pyramidValid = true;
+  }
+
+  float depth(int x, int y) const{
+    return _depth[index(x, y)];
+  }
+
+  // Rasterize the world space box [lo, hi]. Boxes reaching behind the
+  // near plane are skipped rather than clipped, which only ever makes
+  // the buffer less aggressive.
+  bool drawBox(const glm::vec3& lo, const glm::vec3& hi){
+    static const int faces[12][3] = {
+      {0, 1, 3}, {0, 3, 2}, {4, 6, 7}, {4, 7, 5},
+      {0, 4, 5}, {0, 5, 1}, {2, 3, 7}, {2, 7, 6},
+      {0, 2, 6}, {0, 6, 4}, {1, 5, 7}, {1, 7, 3}
+    };
+    glm::vec3 screen[8];
+    for(int i = 0; i < 8; i++){
+      glm::vec4 corner((i & 4) ? hi.x : lo.x, (i & 2) ? hi.y : lo.y, (i & 1) ? hi.z : lo.z, 1.0f);
+      glm::vec4 clip = _viewProjection * corner;
+      if(clip.w <= 1e-5f || clip.z < -clip.w){
+        occludersSkipped++;
+        return false;
+      }
+      screen[i] = toWindow(clip);
+    }
+    for(int f = 0; f < 12; f++){
+      drawTriangle(screen[faces[f][0]], screen[faces[f][1]], screen[faces[f][2]]);
+    }
+    occludersDrawn++;
+    _pyramidValid = false;
+    return true;
+  }
+
+  // Project the sphere to a window rectangle and its nearest depth.
+  // Returns false when the sphere reaches behind the near plane, in
+  // which case it cannot be tested.
+  bool sphereRect(const glm::vec3& center, float radius, int& x0, int& y0, int& x1, int& y1, float& nearest) const{
+    glm::vec3 c = glm::vec3(_view * glm::vec4(center, 1.0f));
+    // the perspective near plane distance is P[3][2] / (P[2][2] - 1)
+    float near = _projection[3][2] / (_projection[2][2] - 1.0f);
+    if(c.z + radius > -near){
+      return false;
+    }
+    float lx = 1.0f, ly = 1.0f, hx = -1.0f, hy = -1.0f;
+    for(int i = 0; i < 8; i++){
+      glm::vec4 corner(c.x + ((i & 1) ? radius : -radius), c.y + ((i & 2) ? radius : -radius), c.z + ((i & 4) ? radius : -radius), 1.0f);
+      glm::vec4 clip = _projection * corner;
+      lx = std::min(lx, clip.x / clip.w);
+      ly = std::min(ly, clip.y / clip.w);
+      hx = std::max(hx, clip.x / clip.w);
+      hy = std::max(hy, clip.y / clip.w);
+    }
+    glm::vec4 front = _projection * glm::vec4(c.x, c.y, c.z + radius, 1.0f);
+    nearest = (front.z / front.w) * 0.5f + 0.5f;
+    x0 = std::max(0, int(floorf((lx * 0.5f + 0.5f) * _width)));
+    y0 = std::max(0, int(floorf((ly * 0.5f + 0.5f) * _height)));
+    x1 = std::min(_width - 1, int(ceilf((hx * 0.5f + 0.5f) * _width)));
+    y1 = std::min(_height - 1, int(ceilf((hy * 0.5f + 0.5f) * _height)));
+    return true;
+  }
+
+  bool isSphereOccluded(const glm::vec3& center, float radius) const{
+    int x0, y0, x1, y1;
+    float nearest;
+    if(!sphereRect(center, radius, x0, y0, x1, y1, nearest)){
+      return false;
+    }
+    if(x0 > x1 || y0 > y1){
+      return false;
+    }
+    return isRectOccluded(x0, y0, x1, y1, nearest);
+  }
+
+  // True if every pixel in [x0, x1] x [y0, y1] holds an occluder
+  // nearer than depth. Reads at most 2x2 texels of the pyramid when
+  // it is up to date and scans the pixels otherwise.
+  bool isRectOccluded(int x0, int y0, int x1, int y1, float depth) const{
+    if(!_pyramidValid){
+      return isRectOccludedExact(x0, y0, x1, y1, depth);
+    }
+    int extent = std::max(x1 - x0, y1 - y0) + 1;
+    int level = 0;
+    while((1 << level) < extent && level < int(_levels.size( ))){
+      level++;
+    }
+    if(level == 0){
+      return isRectOccludedExact(x0, y0, x1, y1, depth);
+    }
+    const std::vector<float>& texels = _levels[level - 1];
+    int lw = _width >> level;
+    for(int y = y0 >> level; y <= y1 >> level; y++){
+      for(int x = x0 >> level; x <= x1 >> level; x++){
+        if(texels[y * lw + x] >= depth){
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // The same test against every pixel of the full resolution buffer.
+  bool isRectOccludedExact(int x0, int y0, int x1, int y1, float depth) const{
+#if defined(__SSE2__)
+    const __m128 limit = _mm_set1_ps(depth);
+    const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    const __m128 first = _mm_set1_ps(float(x0));
+    const __m128 last = _mm_set1_ps(float(x1));
+    for(int y = y0; y <= y1; y++){
+      for(int x = x0 & ~3; x <= x1; x += 4){
+        __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), lane);
+        __m128 inside = _mm_and_ps(_mm_cmpge_ps(px, first), _mm_cmple_ps(px, last));
+        __m128 stored = _mm_loadu_ps(&_depth[index(x, y)]);
+        __m128 visible = _mm_and_ps(inside, _mm_cmpge_ps(stored, limit));
+        if(_mm_movemask_ps(visible)){
+          return false;
+        }
+      }
+    }
+    return true;
+#else
+    for(int y = y0; y <= y1; y++){
+      for(int x = x0; x <= x1; x++){
+        if(_depth[index(x, y)] >= depth){
+          return false;
+        }
+      }
+    }
+    return true;
+#endif
+  }
+
+protected:
+  int _width;
+  int _height;
+  std::vector<float> _depth;
+  std::vector<std::vector<float> > _levels;
+  bool _pyramidValid;
+  glm::mat4 _view;
+  glm::mat4 _projection;
+  glm::mat4 _viewProjection;
+
+  int index(int x, int y) const{
+    int tile = (y / TILE_HEIGHT) * (_width / TILE_WIDTH) + (x / TILE_WIDTH);
+    return tile * (TILE_WIDTH * TILE_HEIGHT) + (y % TILE_HEIGHT) * TILE_WIDTH + (x % TILE_WIDTH);
+  }
+
+  glm::vec3 toWindow(const glm::vec4& clip) const{
+    glm::vec3 ndc = glm::vec3(clip) / clip.w;
+    return glm::vec3((ndc.x * 0.5f + 0.5f) * _width, (ndc.y * 0.5f + 0.5f) * _height, ndc.z * 0.5f + 0.5f);
+  }
+
+  // Fill the pixels whose centers are covered, keeping the nearer depth.
+  void drawTriangle(glm::vec3 a, glm::vec3 b, glm::vec3 c){
+    float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if(fabsf(area) < 1e-8f){
+      return;
+    }
+    if(area < 0){
+      std::swap(b, c);
+      area = -area;
+    }
+    int x0 = std::max(0, int(floorf(std::min(a.x, std::min(b.x, c.x)))));
+    int y0 = std::max(0, int(floorf(std::min(a.y, std::min(b.y, c.y)))));
+    int x1 = std::min(_width - 1, int(ceilf(std::max(a.x, std::max(b.x, c.x)))));
+    int y1 = std::min(_height - 1, int(ceilf(std::max(a.y, std::max(b.y, c.y)))));
+    if(x0 > x1 || y0 > y1){
+      return;
+    }
+    // edge k is e(x, y) = A[k] x + B[k] y + C[k], positive inside
+    const glm::vec3* v[3] = {&a, &b, &c};
+    float A[3], B[3], C[3];
+    for(int k = 0; k < 3; k++){
+      const glm::vec3& p = *v[k];
+      const glm::vec3& q = *v[(k + 1) % 3];
+      A[k] = p.y - q.y;
+      B[k] = q.x - p.x;
+      C[k] = p.x * q.y - p.y * q.x;
+    }
+    // depth plane z(x, y) = zx x + zy y + z0
+    float zx = ((b.z - a.z) * (c.y - a.y) - (c.z - a.z) * (b.y - a.y)) / area;
+    float zy = ((c.z - a.z) * (b.x - a.x) - (b.z - a.z) * (c.x - a.x)) / area;
+    float z0 = a.z - zx * a.x - zy * a.y;
+    trianglesDrawn++;
+#if defined(__SSE2__)
+    const __m128 lane = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+    const __m128 zero = _mm_setzero_ps( );
+    for(int y = y0; y <= y1; y++){
+      float py = y + 0.5f;
+      __m128 rowE0 = _mm_set1_ps(B[0] * py + C[0]);
+      __m128 rowE1 = _mm_set1_ps(B[1] * py + C[1]);
+      __m128 rowE2 = _mm_set1_ps(B[2] * py + C[2]);
+      __m128 rowZ = _mm_set1_ps(zy * py + z0);
+      for(int x = x0 & ~3; x <= x1; x += 4){
+        __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), lane);
+        __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[0]), px), rowE0);
+        __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[1]), px), rowE1);
+        __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[2]), px), rowE2);
+        __m128 covered = _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+        if(!_mm_movemask_ps(covered)){
+          continue;
+        }
+        __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zx), px), rowZ);
+        float* dst = &_depth[index(x, y)];
+        __m128 stored = _mm_loadu_ps(dst);
+        __m128 nearer = _mm_min_ps(stored, z);
+        _mm_storeu_ps(dst, _mm_or_ps(_mm_and_ps(covered, nearer), _mm_andnot_ps(covered, stored)));
+      }
+    }
+#else
+    for(int y = y0; y <= y1; y++){
+      float py = y + 0.5f;
+      for(int x = x0; x <= x1; x++){
+        float px = x + 0.5f;
+        if(A[0] * px + B[0] * py + C[0] >= 0 && A[1] * px + B[1] * py + C[1] >= 0 && A[2] * px + B[2] * py + C[2] >= 0){
+          float& d = _depth[index(x, y)];
+          d = std::min(d, zx * px + zy * py + z0);
+        }
+      }
+    }
+#endif
+  }
+
+};
+
+#endif
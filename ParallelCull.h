@@ -0,0 +1,104 @@
+//
+// Frustum culling of an InstanceStore split into chunks that run on
+// a JobSystem.
+//
+// Every chunk covers a multiple of 32 instances so the chunks write
+// disjoint words of the visibility masks. Each worker gathers the
+// visible indices of the chunks it runs into its own list and records
+// where they went; the lists are then stitched together in chunk
+// order, so the result matches the single threaded compaction
+// without any locking.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+
+#include "Frustum.h"
+#include "InstanceStore.h"
+#include "JobSystem.h"
+#include "frustum_cull.h"
+
+#ifndef _PARALLEL_CULL_H_
+#define _PARALLEL_CULL_H_
+
+class ParallelCuller{
+public:
+  // Statistics of the last cull.
+  uint64_t planeTests;
+
+  ParallelCuller(JobSystem& jobs, size_t chunkSize = 16384): planeTests(0), _jobs(jobs){
+    _chunkSize = std::max(size_t(32), chunkSize & ~size_t(31));
+  }
+
+  // Cull with the SIMD kernel, or with the plane caching kernel when
+  // coherent is set, and fill in the instances' visible list.
+  void cull(const Frustum& frustum, InstanceStore& instances, bool coherent){
+    size_t count = instances.size( );
+    size_t chunks = (count + _chunkSize - 1) / _chunkSize;
+    unsigned int workers = _jobs.workerCount( );
+    _segments.resize(chunks);
+    _local.resize(workers);
+    for(unsigned int w = 0; w < workers; w++){
+      _local[w].clear( );
+    }
+    instances.visibleList.resize(count);
+
+    _jobs.parallelFor(count, _chunkSize, [&](size_t begin, size_t end, unsigned int worker){
+      size_t n = end - begin;
+      uint32_t* visible = &instances.visibleMask[begin >> 5];
+      uint32_t* inside = &instances.insideMask[begin >> 5];
+      Segment& segment = _segments[begin / _chunkSize];
+      segment.tests = 0;
+      if(coherent){
+        segment.tests = frustumCullSpheresCoherent(frustum, &instances.x[begin], &instances.y[begin], &instances.z[begin], &instances.r[begin], n, &instances.lastPlane[begin], visible, inside);
+      }else{
+        frustumCullSpheres(frustum, &instances.x[begin], &instances.y[begin], &instances.z[begin], &instances.r[begin], n, visible, inside);
+      }
+      std::vector<uint32_t>& local = _local[worker];
+      segment.worker = worker;
+      segment.offset = local.size( );
+      local.resize(local.size( ) + n);
+      segment.count = compactVisible(visible, n, &local[segment.offset]);
+      local.resize(segment.offset + segment.count);
+      for(size_t k = segment.offset; k < local.size( ); k++){
+        local[k] += uint32_t(begin);
+      }
+    });
+
+    // the chunks' place in the final list, then copy them there
+    size_t total = 0;
+    planeTests = 0;
+    for(size_t c = 0; c < chunks; c++){
+      _segments[c].destination = total;
+      total += _segments[c].count;
+      planeTests += _segments[c].tests;
+    }
+    _jobs.parallelFor(chunks, 1, [&](size_t begin, size_t end, unsigned int){
+      for(size_t c = begin; c < end; c++){
+        const Segment& segment = _segments[c];
+        if(segment.count){
+          memcpy(&instances.visibleList[segment.destination], &_local[segment.worker][segment.offset], segment.count * sizeof(uint32_t));
+        }
+      }
+    });
+    instances.visibleCount = total;
+  }
+
+private:
+  struct Segment{
+    unsigned int worker;
+    size_t offset;
+    size_t count;
+    size_t destination;
+    uint64_t tests;
+  };
+
+  JobSystem& _jobs;
+  size_t _chunkSize;
+  std::vector<Segment> _segments;
+  std::vector<std::vector<uint32_t> > _local;
+};
+
+#endif
@@ -0,0 +1,127 @@
+//
+// The draws of a frame, each with a 64 bit sort key, radix sorted
+// before they are submitted.
+//
+// From the most significant bit the key holds the program, the level
+// of detail, a coarse view depth on a logarithmic scale, the material
+// and the view depth itself. Sorted, the draws of a program and mesh
+// come together and run front to back, so early depth testing rejects
+// the hidden fragments of dense scenes before they are shaded; draws
+// at about the same depth are grouped by material, and within a
+// material they are front to back again.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+
+#ifndef _RENDER_QUEUE_H_
+#define _RENDER_QUEUE_H_
+
+class RenderQueue{
+public:
+  static const int PROGRAM_BITS = 8;
+  static const int LOD_BITS = 4;
+  static const int BUCKET_BITS = 8;
+  static const int MATERIAL_BITS = 16;
+  static const int DEPTH_BITS = 28;
+
+  // The keys and what each draw draws, the caller's item, in sorted
+  // order after sort( ).
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> items;
+  // Byte passes the last sort needed; the others were all one digit.
+  int sortPasses;
+
+  RenderQueue( ): sortPasses(0), _near(0.1f), _logRange(1.0f){ }
+
+  // The depths the coarse buckets span, logarithmically.
+  void setDepthRange(float near, float far){
+    _near = near;
+    _logRange = 1.0f / std::log(far / near);
+  }
+
+  void clear( ){
+    keys.clear( );
+    items.clear( );
+  }
+
+  size_t size( ) const{
+    return items.size( );
+  }
+
+  void push(uint8_t program, uint8_t lod, uint16_t material, float depth, uint32_t item){
+    keys.push_back(key(program, lod, material, depth));
+    items.push_back(item);
+  }
+
+  uint64_t key(uint8_t program, uint8_t lod, uint16_t material, float depth) const{
+    // nearer than the camera, as when it is inside a bounding sphere
+    depth = depth > 0.0f ? depth : 0.0f;
+    float t = depth > _near ? std::log(depth / _near) * _logRange : 0.0f;
+    uint32_t bucket = uint32_t(std::min(t, 1.0f) * ((1 << BUCKET_BITS) - 1));
+    // the bits of a positive float order like the floats
+    uint32_t bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    uint64_t k = program;
+    k = (k << LOD_BITS) | (lod & ((1 << LOD_BITS) - 1));
+    k = (k << BUCKET_BITS) | bucket;
+    k = (k << MATERIAL_BITS) | material;
+    k = (k << DEPTH_BITS) | (bits >> (32 - DEPTH_BITS));
+    return k;
+  }
+
+  // Least significant digit first radix sort of the keys, a byte at a
+  // time, carrying the items along. It is stable, so draws with equal
+  // keys keep the order they were pushed in.
+  void sort( ){
+    size_t n = keys.size( );
+    sortPasses = 0;
+    if(n < 2){
+      return;
+    }
+    // the histograms of all eight bytes in one sweep
+    size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for(size_t k = 0; k < n; k++){
+      uint64_t key = keys[k];
+      for(int b = 0; b < 8; b++){
+        counts[b][(key >> (8 * b)) & 0xff]++;
+      }
+    }
+    _keys.resize(n);
+    _items.resize(n);
+    for(int b = 0; b < 8; b++){
+      int shift = 8 * b;
+      // every key has the same byte here, nothing moves
+      if(counts[b][(keys[0] >> shift) & 0xff] == n){
+        continue;
+      }
+      size_t next[256];
+      size_t sum = 0;
+      for(int d = 0; d < 256; d++){
+        next[d] = sum;
+        sum += counts[b][d];
+      }
+      for(size_t k = 0; k < n; k++){
+        size_t to = next[(keys[k] >> shift) & 0xff]++;
+        _keys[to] = keys[k];
+        _items[to] = items[k];
+      }
+      keys.swap(_keys);
+      items.swap(_items);
+      sortPasses++;
+    }
+  }
+
+private:
+  float _near;
+  float _logRange;
+  // Where each pass scatters to.
+  std::vector<uint64_t> _keys;
+  std::vector<uint32_t> _items;
+};
+
+#endif
@@ -0,0 +1,242 @@
+//
+// A buffer object for data written anew every frame, split into
+// FRAME_COUNT regions used in turn: while the GPU still draws from
+// the last frames' regions the next one is written.
+//
+// With ARB_buffer_storage and ARB_sync the buffer is mapped once,
+// persistently and coherently, and a fence set after each frame's
+// draws guards its region; beginFrame( ) waits for the fence of the
+// region it moves to, which is only set FRAME_COUNT frames ago, and
+// adds the time waited to the stall time. allocate( ) hands out
+// aligned ranges of the region to write straight into, with no
+// glBufferData reallocation nor copy by the driver.
+//
+// The regions are sized for what a frame asks for: a frame that does
+// not fit reserves more, and the buffer is replaced at the start of
+// the next one.
+//
+// Without them the regions are written in memory of our own and
+// copied to the buffer with glBufferSubData by flush( ).
+//
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <GL/glew.h>
+
+#ifndef _STREAM_BUFFER_H_
+#define _STREAM_BUFFER_H_
+
+class StreamBuffer{
+public:
+  static const int FRAME_COUNT = 3;
+
+  StreamBuffer( ): _buffer(0), _persistent(false), _data(NULL), _regionBytes(0), _reservedBytes(0), _region(0), _offset(0), _frameStallMicroseconds(0.0), _stallMicroseconds(0.0), _stalls(0){
+    std::fill(_fences, _fences + FRAME_COUNT, GLsync(0));
+  }
+
+  ~StreamBuffer( ){
+    release( );
+  }
+
+  static bool isPersistentSupported( ){
+    return GLEW_ARB_buffer_storage && GLEW_ARB_sync;
+  }
+
+  bool isPersistent( ) const{
+    return _persistent;
+  }
+
+  GLuint id( ) const{
+    return _buffer;
+  }
+
+  // Bytes each frame can allocate.
+  size_t regionBytes( ) const{
+    return _regionBytes;
+  }
+
+  // Make each region at least bytes long. A buffer too small is only
+  // replaced by the next beginFrame( ), after waiting for every
+  // region, and meanwhile allocations that do not fit fail; regions
+  // are a power of two bytes, so it seldom grows.
+  void reserve(size_t bytes){
+    _reservedBytes = std::max(_reservedBytes, bytes);
+    if(!_buffer){
+      create(regionBytesFor(_reservedBytes));
+    }
+  }
+
+  // Move on to the next region, waiting until the GPU is done with it.
+  void beginFrame( ){
+    _frameStallMicroseconds = 0.0;
+    if(_buffer && _reservedBytes > _regionBytes){
+      for(int k = 0; k < FRAME_COUNT; k++){
+        wait(k);
+      }
+      size_t reservedBytes = _reservedBytes;
+      release( );
+      _reservedBytes = reservedBytes;
+      create(regionBytesFor(_reservedBytes));
+      return;
+    }
+    _region = (_region + 1) % FRAME_COUNT;
+    _offset = 0;
+    wait(_region);
+  }
+
+  // Fence the current region once the frame's draws using it are
+  // issued.
+  void endFrame( ){
+    if(_persistent && _buffer){
+      _fences[_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+  }
+
+  // Memory for bytes bytes of the current region, starting at a
+  // multiple of alignment, a power of two; offset is set to where it
+  // lies in the buffer, as glVertexAttribPointer wants it. NULL if the
+  // region has no room left. Call it from the thread that begins and
+  // ends the frames; the memory may then be written from any thread.
+  void* allocate(size_t bytes, size_t alignment, size_t& offset){
+    size_t at = (_offset + alignment - 1) & ~(alignment - 1);
+    if(at + bytes > _regionBytes){
+      return NULL;
+    }
+    _offset = at + bytes;
+    offset = _region * _regionBytes + at;
+    return _data + offset;
+  }
+
+  // Make what was written to [offset, offset + bytes) visible to the
+  // GPU; nothing to do for a coherent mapping.
+  void flush(size_t offset, size_t bytes){
+    if(_persistent || bytes == 0){
+      return;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, offset, bytes, _data + offset);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  // Time beginFrame( ) last waited for a fence.
+  double frameStallMicroseconds( ) const{
+    return _frameStallMicroseconds;
+  }
+
+  // Time waited for fences altogether and how many frames waited.
+  double stallMicroseconds( ) const{
+    return _stallMicroseconds;
+  }
+
+  size_t stalls( ) const{
+    return _stalls;
+  }
+
+  void release( ){
+    for(int k = 0; k < FRAME_COUNT; k++){
+      if(_fences[k]){
+        glDeleteSync(_fences[k]);
+        _fences[k] = 0;
+      }
+    }
+    if(_buffer){
+      if(_persistent){
+        glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+      }
+      glDeleteBuffers(1, &_buffer);
+      _buffer = 0;
+    }
+    _data = NULL;
+    _shadow.clear( );
+    _regionBytes = 0;
+    _reservedBytes = 0;
+    _region = 0;
+    _offset = 0;
+  }
+
+private:
+  GLuint _buffer;
+  bool _persistent;
+  // The mapping, or _shadow's memory.
+  unsigned char* _data;
+  std::vector<unsigned char> _shadow;
+  size_t _regionBytes;
+  size_t _reservedBytes;
+  int _region;
+  size_t _offset;
+  GLsync _fences[FRAME_COUNT];
+  double _frameStallMicroseconds;
+  double _stallMicroseconds;
+  size_t _stalls;
+
+  static size_t regionBytesFor(size_t bytes){
+    size_t regionBytes = 65536;
+    while(regionBytes < bytes){
+      regionBytes *= 2;
+    }
+    return regionBytes;
+  }
+
+  // Wait for the fence of region, if any, adding to the stall time.
+  void wait(int region){
+    GLsync fence = _fences[region];
+    if(!fence){
+      return;
+    }
+    _fences[region] = 0;
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if(status == GL_TIMEOUT_EXPIRED){
+      _stalls++;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now( );
+      // flush once so the fence is sure to be reached, then wait a
+      // millisecond at a time
+      GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+      do{
+        status = glClientWaitSync(fence, flags, 1000000);
+        flags = 0;
+      }while(status == GL_TIMEOUT_EXPIRED);
+      double waited = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now( ) - start).count( );
+      _frameStallMicroseconds += waited;
+      _stallMicroseconds += waited;
+    }
+    glDeleteSync(fence);
+  }
+
+  void create(size_t regionBytes){
+    size_t bytes = regionBytes * FRAME_COUNT;
+    _persistent = isPersistentSupported( );
+    glGenBuffers(1, &_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+    if(_persistent){
+      GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_ARRAY_BUFFER, bytes, NULL, flags);
+      _data = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags);
+      if(!_data){
+        // storage is immutable, start over with a buffer of our own
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glDeleteBuffers(1, &_buffer);
+        glGenBuffers(1, &_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+        _persistent = false;
+      }
+    }
+    if(!_persistent){
+      glBufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+      _shadow.resize(bytes);
+      _data = &_shadow[0];
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    _regionBytes = regionBytes;
+    _region = 0;
+    _offset = 0;
+  }
+
+  StreamBuffer(const StreamBuffer&);
+  StreamBuffer& operator=(const StreamBuffer&);
+};
+
+#endif
@@ -0,0 +1,167 @@
+//
+// A chain of teapot meshes at decreasing tessellation grids, each
+// with its geometric error against the surface.
+//
+// The error of a level is the largest distance between a vertex of
+// a uniform mesh on twice the finest grid, standing in for the
+// surface, and the point at the same patch parameters on the level's
+// triangles, in untransformed teapot units. Scaled by a teapot's scale
+// and its pixels per unit on screen it bounds how far, in pixels, the
+// level strays from the surface.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <glm/vec3.hpp>
+#include <glm/geometric.hpp>
+
+#include "JobSystem.h"
+#include "TeapotMesh.h"
+
+#ifndef _TEAPOT_LOD_H_
+#define _TEAPOT_LOD_H_
+
+class TeapotLodChain{
+public:
+  // The chain the app builds: its levels and their grids, coarsest
+  // first.
+  static const int DEFAULT_LEVEL_COUNT = 5;
+
+  static const int* defaultGrids( ){
+    static const int grids[DEFAULT_LEVEL_COUNT] = {2, 4, 7, 12, 20};
+    return grids;
+  }
+
+  // Coarsest level first.
+  std::vector<TeapotMesh> levels;
+  std::vector<float> error;
+  // Triangles a teapot is drawn with at each level.
+  std::vector<size_t> triangles;
+  // Each level's use of a 16 entry LRU vertex cache as tessellated,
+  // patch by patch, and after TeapotMesh::optimize( ).
+  std::vector<VertexCacheStats> cacheBefore;
+  std::vector<VertexCacheStats> cacheAfter;
+
+  size_t size( ) const{
+    return levels.size( );
+  }
+
+  // Tessellate the grids, given coarsest first, in parallel on jobs,
+  // uniformly or adaptively at no more error than uniformly, measure
+  // every level against twice the last grid, then optimize them into
+  // meshlets and list their edges.
+  void build(const int* grids, int count, JobSystem& jobs, bool adaptive = false){
+    levels.assign(count, TeapotMesh( ));
+    error.assign(count, 0.0f);
+    triangles.assign(count, 0);
+    cacheBefore.assign(count, VertexCacheStats( ));
+    cacheAfter.assign(count, VertexCacheStats( ));
+    if(count == 0){
+      return;
+    }
+    // deviation( ) needs the patch by patch layout optimize( ) undoes
+    TeapotMesh reference(2 * grids[count - 1]);
+    jobs.parallelFor(count, 1, [&](size_t begin, size_t end, unsigned int){
+      for(size_t k = begin; k < end; k++){
+        levels[k].tessellate(grids[k]);
+        error[k] = deviation(levels[k], reference);
+        if(adaptive){
+          adapt(levels[k], reference, error[k]);
+        }
+        cacheBefore[k] = levels[k].vertexCacheStats( );
+      }
+    });
+    jobs.parallelFor(count, 1, [&](size_t begin, size_t end, unsigned int){
+      for(size_t k = begin; k < end; k++){
+        levels[k].optimize( );
+        levels[k].buildEdges( );
+        cacheAfter[k] = levels[k].vertexCacheStats( );
+        triangles[k] = levels[k].drawnTriangleCount( );
+      }
+    });
+  }
+
+  // Tessellate mesh adaptively on its grid, tightening the tolerance
+  // until it strays from reference no more than the uniform mesh did,
+  // by error; the flatness bound it starts from is loose on the gently
+  // curved patches. If no tolerance tried gets there with fewer
+  // triangles, the mesh stays uniform. error is set to the mesh's.
+  static void adapt(TeapotMesh& mesh, const TeapotMesh& reference, float& error){
+    float scale = 1.0f;
+    for(int tries = 0; tries < ADAPT_TRIES; tries++){
+      TeapotMesh adapted;
+      adapted.tessellate(mesh.grid, true, scale);
+      float adaptedError = deviation(adapted, reference);
+      if(adaptedError <= error){
+        if(adapted.triangleCount( ) < mesh.triangleCount( )){
+          mesh = adapted;
+          error = adaptedError;
+        }
+        return;
+      }
+      scale *= 0.8f;
+    }
+  }
+
+  // The coarsest level whose error, at pixelsPerUnit, stays within
+  // budget pixels.
+  int select(float pixelsPerUnit, float budget) const{
+    int level = 0;
+    while(level + 1 < int(error.size( )) && error[level] * pixelsPerUnit > budget){
+      level++;
+    }
+    return level;
+  }
+
+  // Largest distance from a vertex of fine, a uniform mesh, to
+  // coarse's triangles at the same patch parameters.
+  static float deviation(const TeapotMesh& coarse, const TeapotMesh& fine){
+    int patches = int(coarse.uSteps.size( ));
+    int f = fine.grid;
+    float largest = 0.0f;
+    for(int patch = 0; patch < patches; patch++){
+      int cu = coarse.uSteps[patch];
+      int cv = coarse.vSteps[patch];
+      size_t coarseBase = coarse.patchBase(patch);
+      size_t fineBase = size_t(patch) * (f + 1) * (f + 1);
+      for(int i = 0; i <= f; i++){
+        for(int j = 0; j <= f; j++){
+          float s = float(i) * cu / f;
+          float t = float(j) * cv / f;
+          int ci = std::min(int(s), cu - 1);
+          int cj = std::min(int(t), cv - 1);
+          s -= ci;
+          t -= cj;
+          // the cell's corners, split along the diagonal b - (a + 1) as
+          // TeapotMesh indexes it
+          size_t a0 = coarseBase + ci * (cv + 1) + cj;
+          glm::vec3 a = position(coarse, a0);
+          glm::vec3 b = position(coarse, a0 + cv + 1);
+          glm::vec3 a1 = position(coarse, a0 + 1);
+          glm::vec3 b1 = position(coarse, a0 + cv + 2);
+          glm::vec3 p;
+          if(s + t <= 1.0f){
+            p = a + s * (b - a) + t * (a1 - a);
+          }else{
+            p = b1 + (1.0f - s) * (a1 - b1) + (1.0f - t) * (b - b1);
+          }
+          largest = std::max(largest, glm::length(p - position(fine, fineBase + i * (f + 1) + j)));
+        }
+      }
+    }
+    return largest;
+  }
+
+private:
+  // Tolerances adapt( ) tries, down to 0.8^11 of the flatness bound.
+  static const int ADAPT_TRIES = 12;
+
+  static glm::vec3 position(const TeapotMesh& mesh, size_t vertex){
+    const float* v = &mesh.vertices[vertex * TeapotMesh::VERTEX_FLOATS];
+    return glm::vec3(v[0], v[1], v[2]);
+  }
+
+};
+
+#endif
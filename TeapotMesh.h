@@ -0,0 +1,503 @@
+//
+// The teapot's Bezier patches tessellated once into an indexed
+// triangle mesh with normals.
+//
+// Only the 10 patches the teapot is built from are tessellated, not
+// their reflections: the first fourFoldIndexCount indices, the rim,
+// body, lid and bottom, are drawn under all MIRROR_COUNT mirror( )
+// sign vectors, the rest, the handle and spout, under the first two.
+//
+// Each patch is evaluated by the CPU tessellator on the same grid x
+// grid mesh glEvalMesh2 produces for _glutSolidTeapotGrid( ), in the
+// same untransformed coordinates, with the normal GL_AUTO_NORMAL would
+// compute. Every patch gets its own (grid + 1)^2 vertices, indexed by
+// two triangles per grid cell.
+//
+// An adaptive mesh instead gives patch p a uSteps[p] x vSteps[p]
+// lattice, as few steps as keep it within the flatness bound the
+// uniform grid guarantees, scaled by a tolerance factor, and fold no
+// triangle over: the flat body gets far fewer triangles, the tightly
+// curved spout and handle about as many. Patches sharing an edge,
+// themselves or reflected, share its steps, so the mesh has no cracks.
+//
+// optimize( ) then welds the vertices neighbouring patches share,
+// orders the triangles of the whole mesh for the post-transform
+// vertex cache, the four fold ones apart, and cuts that order into
+// meshlets where the cache runs cold. The meshlets are ordered
+// against overdraw and the vertices renumbered in the order they are
+// fetched.
+//
+// buildEdges( ) lists every edge of the optimized triangles once, as
+// pairs of indices for GL_LINES, and separately the feature edges:
+// open boundaries and creases where the faces on either side turn by
+// more than a given angle. An edge on a mirror plane meets the
+// reflection of its triangle there, not a boundary.
+//
+// pack( ) encodes the vertices in 10 bytes instead of 24: positions
+// as 16 bit snorm values within the mesh's bounding box and normals as
+// two 16 bit snorm values on the octahedron, which
+// blinn_phong.vert.glsl decodes.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/geometric.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include "bezier_tessellate.h"
+#include "glut_teapot.h"
+#include "mesh_optimize.h"
+#include "Meshlet.h"
+
+#ifndef _TEAPOT_MESH_H_
+#define _TEAPOT_MESH_H_
+
+// How well a mesh's index order uses an LRU post-transform cache.
+class VertexCacheStats{
+public:
+  // vertices transformed per triangle and per vertex referenced
+  float acmr;
+  float atvr;
+  size_t vertexCount;
+
+  VertexCacheStats( ): acmr(0.0f), atvr(0.0f), vertexCount(0){ }
+};
+
+class TeapotMesh{
+public:
+  // Position then normal, three floats each.
+  static const int VERTEX_FLOATS = TESSELLATE_VERTEX_FLOATS;
+  // Three position values then two normal values.
+  static const int PACKED_VERTEX_SHORTS = 5;
+  // The teapot, itself and its reflections in y, x and both.
+  static const int MIRROR_COUNT = 4;
+
+  std::vector<float> vertices;
+  std::vector<uint32_t> indices;
+  std::vector<Meshlet> meshlets;
+  // The level's grid, whether tessellated adaptively or not.
+  int grid;
+  // Steps along u and v of each patch.
+  std::vector<int> uSteps;
+  std::vector<int> vSteps;
+  // Indices and meshlets, from the first on, drawn in every mirror.
+  uint32_t fourFoldIndexCount;
+  uint32_t fourFoldMeshletCount;
+  // Index pairs of every edge and of the feature edges, each with its
+  // count of indices drawn in every mirror.
+  std::vector<uint32_t> edges;
+  std::vector<uint32_t> featureEdges;
+  uint32_t fourFoldEdgeIndexCount;
+  uint32_t fourFoldFeatureIndexCount;
+
+  TeapotMesh( ): grid(0), fourFoldIndexCount(0), fourFoldMeshletCount(0), fourFoldEdgeIndexCount(0), fourFoldFeatureIndexCount(0){ }
+
+  TeapotMesh(int g): fourFoldEdgeIndexCount(0), fourFoldFeatureIndexCount(0){
+    tessellate(g);
+  }
+
+  size_t vertexCount( ) const{
+    return vertices.size( ) / VERTEX_FLOATS;
+  }
+
+  size_t triangleCount( ) const{
+    return indices.size( ) / 3;
+  }
+
+  // Triangles a teapot drawn under every mirror is made of.
+  size_t drawnTriangleCount( ) const{
+    return (2 * indices.size( ) + 2 * size_t(fourFoldIndexCount)) / 3;
+  }
+
+  // Signs to multiply positions and normals by for mirror m. Those
+  // with one negative sign turn the triangles' winding around.
+  static glm::vec3 mirror(int m){
+    return glm::vec3((m & 2) ? -1.0f : 1.0f, (m & 1) ? -1.0f : 1.0f, 1.0f);
+  }
+
+  static bool isFourFold(int m){
+    return m >= 2;
+  }
+
+  // An adaptive mesh keeps within toleranceScale times the uniform
+  // grid's flatness bound.
+  void tessellate(int g, bool adaptive = false, float toleranceScale = 1.0f){
+    grid = g;
+    int patches = _glutTeapotUniquePatchCount( );
+    uSteps.assign(patches, grid);
+    vSteps.assign(patches, grid);
+    if(adaptive){
+      adaptiveSteps(toleranceScale);
+    }
+    vertices.clear( );
+    indices.clear( );
+    meshlets.clear( );
+    fourFoldIndexCount = fourFoldMeshletCount = 0;
+    for(int patch = 0; patch < patches; patch++){
+      GLfloat cp[4][4][3];
+      // the four fold patches come first
+      bool fourFold = _glutTeapotUniquePatch(patch, cp) == MIRROR_COUNT;
+      int side = vSteps[patch] + 1;
+      uint32_t base = uint32_t(vertexCount( ));
+      vertices.resize(vertices.size( ) + size_t(uSteps[patch] + 1) * side * VERTEX_FLOATS);
+      tessellatePatch(cp, uSteps[patch], vSteps[patch], &vertices[size_t(base) * VERTEX_FLOATS]);
+      // the quad strip glEvalMesh2 draws along each column of cells
+      for(int i = 0; i < uSteps[patch]; i++){
+        for(int j = 0; j < vSteps[patch]; j++){
+          uint32_t a = base + i * side + j;
+          uint32_t b = a + side;
+          indices.push_back(a);
+          indices.push_back(b);
+          indices.push_back(a + 1);
+          indices.push_back(a + 1);
+          indices.push_back(b);
+          indices.push_back(b + 1);
+        }
+      }
+      if(fourFold){
+        fourFoldIndexCount = uint32_t(indices.size( ));
+      }
+    }
+  }
+
+  // The index of patch p's first vertex before optimize( ).
+  size_t patchBase(int p) const{
+    size_t base = 0;
+    for(int k = 0; k < p; k++){
+      base += size_t(uSteps[k] + 1) * (vSteps[k] + 1);
+    }
+    return base;
+  }
+
+  // Call after tessellate( ); the patch by patch vertex layout it
+  // produces is gone afterwards.
+  void optimize(unsigned int cacheSize = 16, int targetTriangles = 64){
+    // neighbouring patches meet along shared edges with the same
+    // positions, and where smooth, normals
+    size_t welded = weldVertices(&vertices[0], vertexCount( ), VERTEX_FLOATS, &indices[0], indices.size( ), 1e-5f);
+    vertices.resize(welded * VERTEX_FLOATS);
+    dropDegenerateTriangles( );
+
+    // the whole mesh for the cache, the four fold triangles apart so
+    // they stay in front
+    orderForCache(0, fourFoldIndexCount, cacheSize);
+    orderForCache(fourFoldIndexCount, uint32_t(indices.size( )), cacheSize);
+
+    // cut that order into meshlets where the cache starts over, once a
+    // meshlet has targetTriangles where a strip of the order ends, or
+    // at twice that; the cache being mostly cold there, sorting the
+    // meshlets costs little
+    meshlets.clear( );
+    fourFoldMeshletCount = 0;
+    std::vector<uint32_t> cache;
+    Meshlet cluster;
+    for(uint32_t k = 0; k < indices.size( ); k += 3){
+      int misses = 0;
+      for(int c = 0; c < 3; c++){
+        std::vector<uint32_t>::iterator found = std::find(cache.begin( ), cache.end( ), indices[k + c]);
+        if(found == cache.end( )){
+          misses++;
+          cache.insert(cache.begin( ), indices[k + c]);
+          if(cache.size( ) > cacheSize){
+            cache.pop_back( );
+          }
+        }else{
+          std::rotate(cache.begin( ), found, found + 1);
+        }
+      }
+      uint32_t triangles = cluster.indexCount / 3;
+      bool cut = misses == 3 || (triangles >= uint32_t(targetTriangles) && misses == 2) || triangles >= 2 * uint32_t(targetTriangles);
+      if(triangles > 0 && (k == fourFoldIndexCount || cut)){
+        bound(indices, cluster);
+        meshlets.push_back(cluster);
+        cluster = Meshlet( );
+        cluster.firstIndex = k;
+      }
+      if(k == fourFoldIndexCount){
+        fourFoldMeshletCount = uint32_t(meshlets.size( ));
+      }
+      cluster.indexCount += 3;
+    }
+    if(cluster.indexCount > 0){
+      bound(indices, cluster);
+      meshlets.push_back(cluster);
+    }
+    if(fourFoldIndexCount == indices.size( )){
+      fourFoldMeshletCount = uint32_t(meshlets.size( ));
+    }
+
+    // the meshlets out on the silhouette facing outward first
+    glm::vec3 lo, hi;
+    box(lo, hi);
+    float center[3] = {0.5f * (lo.x + hi.x), 0.5f * (lo.y + hi.y), 0.5f * (lo.z + hi.z)};
+    std::vector<std::pair<float, size_t> > order(meshlets.size( ));
+    for(size_t m = 0; m < meshlets.size( ); m++){
+      order[m] = std::make_pair(-overdrawSortKey(&vertices[0], VERTEX_FLOATS, &indices[0] + meshlets[m].firstIndex, meshlets[m].indexCount, center), m);
+    }
+    // within each group, so the four fold meshlets stay in front
+    std::stable_sort(order.begin( ), order.begin( ) + fourFoldMeshletCount);
+    std::stable_sort(order.begin( ) + fourFoldMeshletCount, order.end( ));
+    std::vector<uint32_t> sorted;
+    std::vector<Meshlet> sortedMeshlets;
+    sorted.reserve(indices.size( ));
+    sortedMeshlets.reserve(meshlets.size( ));
+    for(size_t k = 0; k < order.size( ); k++){
+      Meshlet meshlet = meshlets[order[k].second];
+      uint32_t first = meshlet.firstIndex;
+      meshlet.firstIndex = uint32_t(sorted.size( ));
+      sorted.insert(sorted.end( ), indices.begin( ) + first, indices.begin( ) + first + meshlet.indexCount);
+      sortedMeshlets.push_back(meshlet);
+    }
+    indices.swap(sorted);
+    meshlets.swap(sortedMeshlets);
+
+    size_t fetched = optimizeVertexFetch(&vertices[0], vertexCount( ), VERTEX_FLOATS, &indices[0], indices.size( ));
+    vertices.resize(fetched * VERTEX_FLOATS);
+  }
+
+  // Call after optimize( ). Edges are listed in the order of the first
+  // triangle they belong to, so the four fold ones come first.
+  void buildEdges(float featureDegrees = 40.0f){
+    // each triangle's sides, sorted so duplicates lie together
+    std::vector<std::pair<std::pair<uint32_t, uint32_t>, uint32_t> > sides;
+    sides.reserve(indices.size( ));
+    for(uint32_t k = 0; k < indices.size( ); k++){
+      uint32_t a = indices[k];
+      uint32_t b = indices[k % 3 == 2 ? k - 2 : k + 1];
+      sides.push_back(std::make_pair(std::make_pair(std::min(a, b), std::max(a, b)), k / 3));
+    }
+    std::sort(sides.begin( ), sides.end( ));
+
+    float crease = cosf(featureDegrees * float(M_PI) / 180.0f);
+    uint32_t fourFoldTriangles = fourFoldIndexCount / 3;
+    // each edge's first triangle, then its first side shifted up by
+    // one with the low bit set for features
+    std::vector<std::pair<uint32_t, size_t> > order;
+    for(size_t first = 0, last; first < sides.size( ); first = last){
+      for(last = first + 1; last < sides.size( ) && sides[last].first == sides[first].first; last++){ }
+      glm::vec3 n = faceNormal(sides[first].second);
+      bool sharp;
+      if(last - first == 2){
+        sharp = glm::dot(n, faceNormal(sides[first + 1].second)) < crease;
+      }else if(last - first == 1){
+        // across a mirror plane the neighbour is the reflected triangle
+        glm::vec3 p = position(sides[first].first.first);
+        glm::vec3 q = position(sides[first].first.second);
+        if(std::fabs(p.y) < 1e-4f && std::fabs(q.y) < 1e-4f){
+          sharp = glm::dot(n, n * glm::vec3(1.0f, -1.0f, 1.0f)) < crease;
+        }else if(std::fabs(p.x) < 1e-4f && std::fabs(q.x) < 1e-4f && sides[first].second < fourFoldTriangles){
+          sharp = glm::dot(n, n * glm::vec3(-1.0f, 1.0f, 1.0f)) < crease;
+        }else{
+          sharp = true;
+        }
+      }else{
+        sharp = true;
+      }
+      order.push_back(std::make_pair(sides[first].second, (first << 1) | (sharp ? 1 : 0)));
+    }
+    std::sort(order.begin( ), order.end( ));
+
+    edges.clear( );
+    featureEdges.clear( );
+    fourFoldEdgeIndexCount = fourFoldFeatureIndexCount = 0;
+    for(size_t e = 0; e < order.size( ); e++){
+      const std::pair<uint32_t, uint32_t>& edge = sides[order[e].second >> 1].first;
+      bool fourFold = order[e].first < fourFoldTriangles;
+      edges.push_back(edge.first);
+      edges.push_back(edge.second);
+      fourFoldEdgeIndexCount += fourFold ? 2 : 0;
+      if(order[e].second & 1){
+        featureEdges.push_back(edge.first);
+        featureEdges.push_back(edge.second);
+        fourFoldFeatureIndexCount += fourFold ? 2 : 0;
+      }
+    }
+  }
+
+  VertexCacheStats vertexCacheStats(unsigned int cacheSize = 16) const{
+    VertexCacheStats stats;
+    stats.vertexCount = vertexCount( );
+    analyzeVertexCache(&indices[0], indices.size( ), vertexCount( ), cacheSize, &stats.acmr, &stats.atvr);
+    return stats;
+  }
+
+  // PACKED_VERTEX_SHORTS values per vertex; a vertex's position is
+  // offset + scale * its snorm position values.
+  void pack(std::vector<int16_t>& packed, glm::vec3& offset, glm::vec3& scale) const{
+    glm::vec3 lo, hi;
+    box(lo, hi);
+    offset = 0.5f * (lo + hi);
+    scale = glm::max(0.5f * (hi - lo), glm::vec3(1e-6f));
+    packed.resize(vertexCount( ) * PACKED_VERTEX_SHORTS);
+    for(size_t v = 0; v < vertexCount( ); v++){
+      const float* f = &vertices[v * VERTEX_FLOATS];
+      int16_t* p = &packed[v * PACKED_VERTEX_SHORTS];
+      glm::vec3 q = (glm::vec3(f[0], f[1], f[2]) - offset) / scale;
+      glm::vec2 n = octahedral(glm::vec3(f[3], f[4], f[5]));
+      p[0] = int16_t(glm::packSnorm1x16(q.x));
+      p[1] = int16_t(glm::packSnorm1x16(q.y));
+      p[2] = int16_t(glm::packSnorm1x16(q.z));
+      p[3] = int16_t(glm::packSnorm1x16(n.x));
+      p[4] = int16_t(glm::packSnorm1x16(n.y));
+    }
+  }
+
+private:
+  // The adaptive steps of the unique patches within the flatness
+  // bound of the uniform grid, agreed on along the edges all 32
+  // patches share, reflections included.
+  void adaptiveSteps(float toleranceScale){
+    int count = _glutTeapotPatchCount( );
+    std::vector<GLfloat> all(size_t(count) * 48);
+    GLfloat (*patches)[4][4][3] = (GLfloat (*)[4][4][3])&all[0];
+    for(int n = 0; n < count; n++){
+      _glutTeapotPatch(n, patches[n]);
+    }
+    float tolerance = 0.0f;
+    for(int n = 0; n < count; n++){
+      tolerance = std::max(tolerance, flatnessBound(patches[n], grid, grid));
+    }
+    std::vector<int> us(count), vs(count);
+    adaptivePatchSteps(patches, count, tolerance * toleranceScale, 4 * grid, &us[0], &vs[0]);
+    // each unique patch is one of the 32 unreflected
+    for(int p = 0; p < int(uSteps.size( )); p++){
+      GLfloat cp[4][4][3];
+      _glutTeapotUniquePatch(p, cp);
+      for(int n = 0; n < count; n++){
+        if(memcmp(cp, patches[n], sizeof(cp)) == 0){
+          uSteps[p] = us[n];
+          vSteps[p] = vs[n];
+          break;
+        }
+      }
+    }
+  }
+
+  // The unit normal n projected onto the octahedron |x| + |y| + |z| =
+  // 1, with the lower half folded out over the corners of the square.
+  static glm::vec2 octahedral(const glm::vec3& n){
+    float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+    if(l1 <= 0.0f){
+      return glm::vec2(0.0f);
+    }
+    glm::vec2 e(n.x / l1, n.y / l1);
+    if(n.z < 0.0f){
+      e = glm::vec2((1.0f - std::fabs(e.y)) * (e.x >= 0.0f ? 1.0f : -1.0f), (1.0f - std::fabs(e.x)) * (e.y >= 0.0f ? 1.0f : -1.0f));
+    }
+    return e;
+  }
+
+  // Welding collapses the triangles at the poles of a patch to lines.
+  void dropDegenerateTriangles( ){
+    size_t kept = 0;
+    uint32_t fourFold = 0;
+    for(size_t k = 0; k < indices.size( ); k += 3){
+      uint32_t a = indices[k];
+      uint32_t b = indices[k + 1];
+      uint32_t c = indices[k + 2];
+      if(a != b && b != c && a != c){
+        indices[kept++] = a;
+        indices[kept++] = b;
+        indices[kept++] = c;
+      }
+      if(k + 3 == fourFoldIndexCount){
+        fourFold = uint32_t(kept);
+      }
+    }
+    fourFoldIndexCount = fourFold;
+    indices.resize(kept);
+  }
+
+  // Reorder the triangles of indices [first, last) for the cache,
+  // unless the column by column order of a fine enough grid is better
+  // already.
+  void orderForCache(uint32_t first, uint32_t last, unsigned int cacheSize){
+    if(first == last){
+      return;
+    }
+    std::vector<uint32_t> reordered(indices.begin( ) + first, indices.begin( ) + last);
+    optimizeVertexCache(&reordered[0], reordered.size( ), vertexCount( ), cacheSize);
+    float acmr, reorderedAcmr, atvr;
+    analyzeVertexCache(&indices[first], last - first, vertexCount( ), cacheSize, &acmr, &atvr);
+    analyzeVertexCache(&reordered[0], reordered.size( ), vertexCount( ), cacheSize, &reorderedAcmr, &atvr);
+    if(reorderedAcmr < acmr){
+      std::copy(reordered.begin( ), reordered.end( ), indices.begin( ) + first);
+    }
+  }
+
+  // The box around the vertices.
+  void box(glm::vec3& lo, glm::vec3& hi) const{
+    lo = hi = position(0);
+    for(uint32_t v = 1; v < vertexCount( ); v++){
+      lo = glm::min(lo, position(v));
+      hi = glm::max(hi, position(v));
+    }
+  }
+
+  glm::vec3 position(uint32_t vertex) const{
+    const float* v = &vertices[size_t(vertex) * VERTEX_FLOATS];
+    return glm::vec3(v[0], v[1], v[2]);
+  }
+
+  // The unit normal of triangle t, or zero if it is collapsed.
+  glm::vec3 faceNormal(uint32_t t) const{
+    glm::vec3 a = position(indices[3 * t]);
+    glm::vec3 n = glm::cross(position(indices[3 * t + 1]) - a, position(indices[3 * t + 2]) - a);
+    float length = glm::length(n);
+    return (length > 1e-12f) ? n / length : glm::vec3(0.0f);
+  }
+
+  // The bounding sphere and normal cone of the meshlet's triangles in
+  // order.
+  void bound(const std::vector<uint32_t>& order, Meshlet& meshlet) const{
+    uint32_t first = meshlet.firstIndex;
+    uint32_t last = first + meshlet.indexCount;
+    glm::vec3 lo = position(order[first]);
+    glm::vec3 hi = lo;
+    for(uint32_t k = first; k < last; k++){
+      lo = glm::min(lo, position(order[k]));
+      hi = glm::max(hi, position(order[k]));
+    }
+    meshlet.center = 0.5f * (lo + hi);
+    meshlet.radius = 0.0f;
+    std::vector<glm::vec3> normals;
+    glm::vec3 sum(0.0f);
+    for(uint32_t k = first; k < last; k += 3){
+      glm::vec3 a = position(order[k]);
+      glm::vec3 b = position(order[k + 1]);
+      glm::vec3 c = position(order[k + 2]);
+      meshlet.radius = std::max(meshlet.radius, glm::length(a - meshlet.center));
+      meshlet.radius = std::max(meshlet.radius, glm::length(b - meshlet.center));
+      meshlet.radius = std::max(meshlet.radius, glm::length(c - meshlet.center));
+      glm::vec3 n = glm::cross(b - a, c - a);
+      float length = glm::length(n);
+      // triangles collapsed at the poles of a patch face nowhere
+      if(length > 1e-9f){
+        normals.push_back(n / length);
+        sum += n / length;
+      }
+    }
+    meshlet.coneAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+    meshlet.coneCutoff = 1.0f;
+    if(normals.empty( ) || glm::length(sum) < 1e-6f){
+      return;
+    }
+    meshlet.coneAxis = glm::normalize(sum);
+    float spread = 1.0f;
+    for(size_t k = 0; k < normals.size( ); k++){
+      spread = std::min(spread, glm::dot(meshlet.coneAxis, normals[k]));
+    }
+    if(spread > 0.0f){
+      meshlet.coneCutoff = sqrtf(1.0f - spread * spread);
+    }
+  }
+
+};
+
+#endif
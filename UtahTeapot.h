@@ -7,7 +7,13 @@
 //
 
 #include <iostream>
+#include <utility>
+#include <vector>
 #include <glm/vec3.hpp>
+#include "Frustum.h"
+#include "MeshBuffer.h"
+#include "MeshCache.h"
+#include "TeapotLod.h"
 #include "glut_teapot.h"
 #include "Material.h"
 
@@ -18,17 +24,19 @@ class UtahTeapot{
 public:
   glm::vec3 position;
   float scale;
+  // A material of its own, or NULL for one shared through the index
+  // of a MaterialTable.
   Material *material;
-  bool visible;
+  uint16_t materialIndex;
 
-  UtahTeapot(glm::vec3 pos, float s, Material* m): position(pos), scale(s){
+  UtahTeapot(glm::vec3 pos, float s, Material* m): position(pos), scale(s), materialIndex(0){
     material = m;
-    visible = true;
   }
+
+  UtahTeapot(glm::vec3 pos, float s, uint16_t index): position(pos), scale(s), material(NULL), materialIndex(index){ }
   
-  UtahTeapot( ):position(glm::vec3(0, 0, 0)), scale(1.0){
+  UtahTeapot( ):position(glm::vec3(0, 0, 0)), scale(1.0), materialIndex(0){
     material = new Material(glm::vec4(0.2, 0.2, 0.2, 1.0), glm::vec4(0.5, 0.5, 0.5, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0);
-    visible = true;
   }
   
   ~UtahTeapot( ){
@@ -36,16 +44,262 @@ public:
   }
 
   void draw( ){
-    _glutSolidTeapot(scale);
+    draw(7);
+  }
+
+  // Draw with each patch evaluated on a grid x grid mesh; draw( )
+  // uses 7. A mesh loaded with loadMeshes( ) holds a single copy of
+  // each mirrored patch and is drawn with an indexed draw per mirror,
+  // otherwise the patches are evaluated on the fly. The model-view
+  // matrix places and scales the loaded mesh.
+  void draw(int grid){
+    std::vector<MeshBuffer*>& buffers = meshBuffers( );
+    if(grid < int(buffers.size( )) && buffers[grid]){
+      const LoadedMesh& mesh = loadedMeshes( )[grid];
+      for(int m = 0; m < TeapotMesh::MIRROR_COUNT; m++){
+        MeshBuffer::mirror(TeapotMesh::mirror(m));
+        buffers[grid]->draw(TeapotMesh::isFourFold(m) ? mesh.fourFoldIndexCount : buffers[grid]->indexCount( ));
+      }
+      MeshBuffer::mirror(TeapotMesh::mirror(0));
+    }else{
+      MeshBuffer::unpackedVertices( );
+      _glutSolidTeapotGrid(grid, scale);
+    }
+  }
+
+  // Draw count teapots with the grid x grid mesh, one instanced draw
+  // per mirror, with the attributes of the instances of the bound
+  // InstanceBuffer. The mesh must be loaded.
+  static void drawInstanced(int grid, GLsizei count){
+    std::vector<MeshBuffer*>& buffers = meshBuffers( );
+    if(grid >= int(buffers.size( )) || !buffers[grid]){
+      return;
+    }
+    const LoadedMesh& mesh = loadedMeshes( )[grid];
+    for(int m = 0; m < TeapotMesh::MIRROR_COUNT; m++){
+      MeshBuffer::mirror(TeapotMesh::mirror(m));
+      buffers[grid]->drawInstanced(TeapotMesh::isFourFold(m) ? mesh.fourFoldIndexCount : buffers[grid]->indexCount( ), count);
+    }
+    MeshBuffer::mirror(TeapotMesh::mirror(0));
+  }
+
+  // Draw the edges of the grid x grid mesh as lines, every edge or
+  // only the feature edges, with a single call per mirror. Without a
+  // loaded mesh the patches are evaluated as lines on the fly.
+  void drawEdges(int grid, bool features){
+    std::vector<MeshBuffer*>& buffers = meshBuffers( );
+    if(grid < int(buffers.size( )) && buffers[grid]){
+      const LoadedMesh& mesh = loadedMeshes( )[grid];
+      for(int m = 0; m < TeapotMesh::MIRROR_COUNT; m++){
+        MeshBuffer::mirror(TeapotMesh::mirror(m));
+        GLsizei fourFold = features ? mesh.fourFoldFeatureIndexCount : mesh.fourFoldEdgeIndexCount;
+        buffers[grid]->drawEdges(features, TeapotMesh::isFourFold(m) ? fourFold : buffers[grid]->edgeIndexCount(features));
+      }
+      MeshBuffer::mirror(TeapotMesh::mirror(0));
+    }else{
+      MeshBuffer::unpackedVertices( );
+      _glutWireTeapot(scale);
+    }
+  }
+
+  // Like draw(grid) but skip the meshlets outside frustum or facing
+  // away from eye, both in world coordinates, and draw the rest with
+  // a single call per mirror.
+  void drawClusters(int grid, const Frustum& frustum, const glm::vec3& eye, MeshletStats& stats){
+    std::vector<MeshBuffer*>& buffers = meshBuffers( );
+    if(grid >= int(buffers.size( )) || !buffers[grid]){
+      draw(grid);
+      return;
+    }
+    static std::vector<GLsizei> counts;
+    static std::vector<const GLvoid*> offsets;
+    const LoadedMesh& mesh = loadedMeshes( )[grid];
+    for(int mirror = 0; mirror < TeapotMesh::MIRROR_COUNT; mirror++){
+      counts.clear( );
+      offsets.clear( );
+      // a mirror is its own inverse: reflect the eye into the mesh
+      glm::vec3 signs = TeapotMesh::mirror(mirror);
+      glm::vec3 localEye = signs * (eye - position) / scale;
+      size_t meshletCount = TeapotMesh::isFourFold(mirror) ? mesh.fourFoldMeshletCount : mesh.meshletCount;
+      uint32_t end = 0;
+      for(size_t k = 0; k < meshletCount; k++){
+        const Meshlet& m = mesh.meshlets[k];
+        if(m.isBackFacing(localEye)){
+          stats.backFacing++;
+          continue;
+        }
+        if(frustum.classifySphere(position + signs * m.center * scale, m.radius * scale) == Frustum::OUTSIDE){
+          stats.outside++;
+          continue;
+        }
+        stats.drawn++;
+        // neighbouring meshlets that both survive are drawn as one run
+        if(!counts.empty( ) && end == m.firstIndex){
+          counts.back( ) += m.indexCount;
+        }else{
+          counts.push_back(m.indexCount);
+          offsets.push_back(MeshBuffer::indexOffset(m.firstIndex));
+        }
+        end = m.firstIndex + m.indexCount;
+      }
+      if(!counts.empty( )){
+        MeshBuffer::mirror(signs);
+        buffers[grid]->drawRanges(counts, offsets);
+      }
+    }
+    MeshBuffer::mirror(TeapotMesh::mirror(0));
+  }
+
+  // Keep every level of the chain in buffer objects, packed to 10
+  // bytes a vertex or as floats. The chain must outlive the teapots'
+  // drawing. Needs a current OpenGL context. Returns the bytes of
+  // vertex data loaded.
+  static size_t loadMeshes(const TeapotLodChain& chain, bool packed){
+    size_t bytes = 0;
+    std::vector<MeshBuffer*>& buffers = meshBuffers( );
+    for(size_t k = 0; k < chain.size( ); k++){
+      const TeapotMesh& mesh = chain.levels[k];
+      if(!slot(mesh.grid)){
+        LoadedMesh& loaded = loadedMeshes( )[mesh.grid];
+        loaded = LoadedMesh(mesh.meshlets.empty( ) ? NULL : &mesh.meshlets[0], mesh.meshlets.size( ), mesh.fourFoldMeshletCount, mesh.fourFoldIndexCount);
+        loaded.fourFoldEdgeIndexCount = mesh.fourFoldEdgeIndexCount;
+        loaded.fourFoldFeatureIndexCount = mesh.fourFoldFeatureIndexCount;
+        buffers[mesh.grid] = new MeshBuffer( );
+        if(packed){
+          std::vector<int16_t> vertices;
+          glm::vec3 offset, scale;
+          mesh.pack(vertices, offset, scale);
+          buffers[mesh.grid]->uploadPacked(vertices, TeapotMesh::PACKED_VERTEX_SHORTS, offset, scale, mesh.indices);
+        }else{
+          buffers[mesh.grid]->upload(mesh.vertices, TeapotMesh::VERTEX_FLOATS, mesh.indices);
+        }
+        buffers[mesh.grid]->uploadEdges(mesh.edges.empty( ) ? NULL : &mesh.edges[0], mesh.edges.size( ), mesh.featureEdges.empty( ) ? NULL : &mesh.featureEdges[0], mesh.featureEdges.size( ));
+        bytes += buffers[mesh.grid]->vertexBytes( );
+      }
+    }
+    return bytes;
+  }
+
+  // The same straight from a mapped cache, which must stay open while
+  // the teapots are drawn.
+  static size_t loadMeshes(const MeshCache& cache, bool packed){
+    size_t bytes = 0;
+    std::vector<MeshBuffer*>& buffers = meshBuffers( );
+    for(int k = 0; k < cache.levelCount( ); k++){
+      const MeshCacheLevel& level = cache.level(k);
+      if(!slot(level.grid)){
+        LoadedMesh& loaded = loadedMeshes( )[level.grid];
+        loaded = LoadedMesh(cache.meshlets(k), size_t(level.meshletCount), size_t(level.fourFoldMeshletCount), GLsizei(level.fourFoldIndexCount));
+        loaded.fourFoldEdgeIndexCount = GLsizei(level.fourFoldEdgeIndexCount);
+        loaded.fourFoldFeatureIndexCount = GLsizei(level.fourFoldFeatureIndexCount);
+        buffers[level.grid] = new MeshBuffer( );
+        if(packed){
+          glm::vec3 offset(level.packedOffset[0], level.packedOffset[1], level.packedOffset[2]);
+          glm::vec3 scale(level.packedScale[0], level.packedScale[1], level.packedScale[2]);
+          buffers[level.grid]->uploadPacked(cache.packedVertices(k), level.vertexCount, TeapotMesh::PACKED_VERTEX_SHORTS, offset, scale, cache.indices(k), level.indexCount);
+        }else{
+          buffers[level.grid]->upload(cache.vertices(k), level.vertexCount, TeapotMesh::VERTEX_FLOATS, cache.indices(k), level.indexCount);
+        }
+        buffers[level.grid]->uploadEdges(cache.edges(k), level.edgeIndexCount, cache.featureEdges(k), level.featureIndexCount);
+        bytes += buffers[level.grid]->vertexBytes( );
+      }
+    }
+    return bytes;
+  }
+
+  static void releaseMeshes( ){
+    std::vector<MeshBuffer*>& buffers = meshBuffers( );
+    for(size_t k = 0; k < buffers.size( ); k++){
+      delete buffers[k];
+    }
+    buffers.clear( );
+    loadedMeshes( ).clear( );
+  }
+
+  // Bounding sphere of the Bezier control points, scaled
+  // and moved to the teapot's position.
+  glm::vec3 boundingCenter( ){
+    return position + unitBoundingCenter( ) * scale;
+  }
+
+  float boundingRadius( ){
+    return unitBoundingRadius( ) * scale;
+  }
+
+  // A box that lies entirely inside the teapot's body, for use as an
+  // occluder. Between z = 0.15 and the rim at z = 2.4 the body's
+  // patches stay at least 1.5 from the z axis, so a square of half
+  // side 1.5 / sqrt(2) fits inside every cross section.
+  void occluderBox(glm::vec3& lo, glm::vec3& hi){
+    lo = position + glm::vec3(-1.05, -1.05, 0.15) * scale;
+    hi = position + glm::vec3(1.05, 1.05, 2.4) * scale;
+  }
+
+  static glm::vec3 unitBoundingCenter( ){
+    static glm::vec3 center = computeUnitBounds( ).first;
+    return center;
+  }
+
+  static float unitBoundingRadius( ){
+    static float radius = computeUnitBounds( ).second;
+    return radius;
   }
 
   void debug( ){
     std::cerr << "UtahTeapot" << std::endl;
     std::cerr << "position: " << glm::to_string(position) << std::endl;
     std::cerr << "scale: " << scale << std::endl;
-    material->debug( );
+    std::cerr << "bounding center: " << glm::to_string(boundingCenter( )) << std::endl;
+    std::cerr << "bounding radius: " << boundingRadius( ) << std::endl;
+    std::cerr << "material index: " << materialIndex << std::endl;
+    if(material){
+      material->debug( );
+    }
+  }
+
+private:
+  // One mesh per grid size, indexed by the grid.
+  static std::vector<MeshBuffer*>& meshBuffers( ){
+    static std::vector<MeshBuffer*> buffers;
+    return buffers;
   }
 
+  // What drawing needs of the mesh in a buffer besides the buffer.
+  class LoadedMesh{
+  public:
+    const Meshlet* meshlets;
+    size_t meshletCount;
+    size_t fourFoldMeshletCount;
+    GLsizei fourFoldIndexCount;
+    GLsizei fourFoldEdgeIndexCount;
+    GLsizei fourFoldFeatureIndexCount;
+
+    LoadedMesh( ): meshlets(NULL), meshletCount(0), fourFoldMeshletCount(0), fourFoldIndexCount(0), fourFoldEdgeIndexCount(0), fourFoldFeatureIndexCount(0){ }
+
+    LoadedMesh(const Meshlet* m, size_t count, size_t fourFoldCount, GLsizei fourFoldIndices): meshlets(m), meshletCount(count), fourFoldMeshletCount(fourFoldCount), fourFoldIndexCount(fourFoldIndices), fourFoldEdgeIndexCount(0), fourFoldFeatureIndexCount(0){ }
+  };
+
+  static std::vector<LoadedMesh>& loadedMeshes( ){
+    static std::vector<LoadedMesh> meshes;
+    return meshes;
+  }
+
+  // True if a mesh is loaded for grid, after making room for one.
+  static bool slot(int grid){
+    std::vector<MeshBuffer*>& buffers = meshBuffers( );
+    if(grid >= int(buffers.size( ))){
+      buffers.resize(grid + 1, NULL);
+      loadedMeshes( ).resize(grid + 1);
+    }
+    return buffers[grid] != NULL;
+  }
+
+  static std::pair<glm::vec3, float> computeUnitBounds( ){
+    GLfloat c[3];
+    GLfloat r;
+    _glutTeapotBoundingSphere(c, &r);
+    return std::make_pair(glm::vec3(c[0], c[1], c[2]), r);
+  }
 
 };
 
@@ -0,0 +1,495 @@
+//
+// CPU tessellation of bicubic Bezier patches.
+//
+// The patch is evaluated with its basis matrices one row of the
+// lattice at a time. The u weights of the row fold the 4x4 control
+// points into four points along v and four u derivatives; every
+// vertex of the row is then a 4 term weighted sum of those, with the
+// v weights of all vertices precomputed once per patch. The kernels
+// keep the weights and results as separate arrays so a SIMD register
+// holds the same component of 4 (SSE2) or 8 (AVX2) vertices of the
+// row, and interleave them into the output at the end of the row.
+//
+// adaptivePatchSteps( ) picks the steps per patch from the bound of
+// Filip, Magedson and Markot on how far the triangles of a lattice
+// stray from a surface with bounded second derivatives, and makes
+// patches agree on the steps along every boundary curve they share.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "bezier_tessellate.h"
+
+// Cubic Bernstein polynomials and their derivatives at t.
+static void bernstein(float t, float b[4], float db[4]){
+  float s = 1.0f - t;
+  b[0] = s * s * s;
+  b[1] = 3.0f * t * s * s;
+  b[2] = 3.0f * t * t * s;
+  b[3] = t * t * t;
+  db[0] = -3.0f * s * s;
+  db[1] = 3.0f * s * s - 6.0f * t * s;
+  db[2] = 6.0f * t * s - 3.0f * t * t;
+  db[3] = 3.0f * t * t;
+}
+
+// Fold the control points with the u weights of one row: R[j] is the
+// point and D[j] the u derivative of the curve along u through row j.
+static void foldRow(const float cp[4][4][3], float u, float R[4][3], float D[4][3]){
+  float bu[4], dbu[4];
+  bernstein(u, bu, dbu);
+  for(int j = 0; j < 4; j++){
+    for(int l = 0; l < 3; l++){
+      R[j][l] = 0.0f;
+      D[j][l] = 0.0f;
+      for(int k = 0; k < 4; k++){
+        R[j][l] += bu[k] * cp[j][k][l];
+        D[j][l] += dbu[k] * cp[j][k][l];
+      }
+    }
+  }
+}
+
+static void cross(const float a[3], const float b[3], float c[3]){
+  c[0] = a[1] * b[2] - a[2] * b[1];
+  c[1] = a[2] * b[0] - a[0] * b[2];
+  c[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// The unnormalized normal dP/du x dP/dv at (u, v).
+static void normalAt(const float cp[4][4][3], float u, float v, float n[3]){
+  float R[4][3], D[4][3], bv[4], dbv[4], du[3], dv[3];
+  foldRow(cp, u, R, D);
+  bernstein(v, bv, dbv);
+  for(int l = 0; l < 3; l++){
+    du[l] = bv[0] * D[0][l] + bv[1] * D[1][l] + bv[2] * D[2][l] + bv[3] * D[3][l];
+    dv[l] = dbv[0] * R[0][l] + dbv[1] * R[1][l] + dbv[2] * R[2][l] + dbv[3] * R[3][l];
+  }
+  cross(du, dv, n);
+}
+
+// The v weights of every vertex of a row, padded with copies of the
+// last one to a multiple of lanes.
+struct RowWeights{
+  std::vector<float> b[4];
+  std::vector<float> db[4];
+  int count;
+  int padded;
+
+  RowWeights(int steps, int lanes){
+    count = steps + 1;
+    padded = (count + lanes - 1) / lanes * lanes;
+    for(int j = 0; j < 4; j++){
+      b[j].resize(padded);
+      db[j].resize(padded);
+    }
+    for(int m = 0; m < padded; m++){
+      float w[4], dw[4];
+      bernstein(float(std::min(m, steps)) / steps, w, dw);
+      for(int j = 0; j < 4; j++){
+        b[j][m] = w[j];
+        db[j][m] = dw[j];
+      }
+    }
+  }
+};
+
+// Positions, normals and normal lengths of one row, component by
+// component.
+struct RowResults{
+  std::vector<float> c[7];
+
+  RowResults(int padded){
+    for(int l = 0; l < 7; l++){
+      c[l].resize(padded);
+    }
+  }
+};
+
+// Interleave row i into the output, replacing the normals of points
+// where the patch collapses.
+static void storeRow(const float cp[4][4][3], int uSteps, int vSteps, int i, const RowResults& row, float* vertices){
+  int count = vSteps + 1;
+  float* out = vertices + size_t(i) * count * TESSELLATE_VERTEX_FLOATS;
+  for(int m = 0; m < count; m++, out += TESSELLATE_VERTEX_FLOATS){
+    for(int l = 0; l < 6; l++){
+      out[l] = row.c[l][m];
+    }
+    if(row.c[6][m] < 1e-6f){
+      float u = float(i) / uSteps;
+      float v = float(m) / vSteps;
+      float n[3];
+      normalAt(cp, u + (u < 0.5f ? 1e-3f : -1e-3f), v + (v < 0.5f ? 1e-3f : -1e-3f), n);
+      float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+      out[3] = (length > 0.0f) ? n[0] / length : 0.0f;
+      out[4] = (length > 0.0f) ? n[1] / length : 0.0f;
+      out[5] = (length > 0.0f) ? n[2] / length : 1.0f;
+    }
+  }
+}
+
+void tessellatePatchScalar(const float cp[4][4][3], int uSteps, int vSteps, float* vertices){
+  RowWeights w(vSteps, 1);
+  RowResults row(w.padded);
+  for(int i = 0; i <= uSteps; i++){
+    float R[4][3], D[4][3];
+    foldRow(cp, float(i) / uSteps, R, D);
+    for(int m = 0; m < w.count; m++){
+      float p[3], du[3], dv[3], n[3];
+      for(int l = 0; l < 3; l++){
+        p[l] = du[l] = dv[l] = 0.0f;
+        for(int j = 0; j < 4; j++){
+          p[l] += w.b[j][m] * R[j][l];
+          du[l] += w.b[j][m] * D[j][l];
+          dv[l] += w.db[j][m] * R[j][l];
+        }
+      }
+      cross(du, dv, n);
+      float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+      float inverse = (length > 0.0f) ? 1.0f / length : 0.0f;
+      for(int l = 0; l < 3; l++){
+        row.c[l][m] = p[l];
+        row.c[3 + l][m] = n[l] * inverse;
+      }
+      row.c[6][m] = length;
+    }
+    storeRow(cp, uSteps, vSteps, i, row, vertices);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+void tessellatePatchSSE2(const float cp[4][4][3], int uSteps, int vSteps, float* vertices){
+  RowWeights w(vSteps, 4);
+  RowResults row(w.padded);
+  for(int i = 0; i <= uSteps; i++){
+    float R[4][3], D[4][3];
+    foldRow(cp, float(i) / uSteps, R, D);
+    for(int m = 0; m < w.padded; m += 4){
+      __m128 p[3], du[3], dv[3];
+      for(int l = 0; l < 3; l++){
+        p[l] = du[l] = dv[l] = _mm_setzero_ps( );
+      }
+      for(int j = 0; j < 4; j++){
+        __m128 b = _mm_loadu_ps(&w.b[j][m]);
+        __m128 db = _mm_loadu_ps(&w.db[j][m]);
+        for(int l = 0; l < 3; l++){
+          p[l] = _mm_add_ps(p[l], _mm_mul_ps(b, _mm_set1_ps(R[j][l])));
+          du[l] = _mm_add_ps(du[l], _mm_mul_ps(b, _mm_set1_ps(D[j][l])));
+          dv[l] = _mm_add_ps(dv[l], _mm_mul_ps(db, _mm_set1_ps(R[j][l])));
+        }
+      }
+      __m128 nx = _mm_sub_ps(_mm_mul_ps(du[1], dv[2]), _mm_mul_ps(du[2], dv[1]));
+      __m128 ny = _mm_sub_ps(_mm_mul_ps(du[2], dv[0]), _mm_mul_ps(du[0], dv[2]));
+      __m128 nz = _mm_sub_ps(_mm_mul_ps(du[0], dv[1]), _mm_mul_ps(du[1], dv[0]));
+      __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)));
+      // zero length normals come out as zero rather than NaN
+      __m128 nonzero = _mm_cmpgt_ps(length, _mm_setzero_ps( ));
+      __m128 inverse = _mm_and_ps(nonzero, _mm_div_ps(_mm_set1_ps(1.0f), length));
+      _mm_storeu_ps(&row.c[0][m], p[0]);
+      _mm_storeu_ps(&row.c[1][m], p[1]);
+      _mm_storeu_ps(&row.c[2][m], p[2]);
+      _mm_storeu_ps(&row.c[3][m], _mm_mul_ps(nx, inverse));
+      _mm_storeu_ps(&row.c[4][m], _mm_mul_ps(ny, inverse));
+      _mm_storeu_ps(&row.c[5][m], _mm_mul_ps(nz, inverse));
+      _mm_storeu_ps(&row.c[6][m], length);
+    }
+    storeRow(cp, uSteps, vSteps, i, row, vertices);
+  }
+}
+
+__attribute__((target("avx2,fma")))
+void tessellatePatchAVX2(const float cp[4][4][3], int uSteps, int vSteps, float* vertices){
+  RowWeights w(vSteps, 8);
+  RowResults row(w.padded);
+  for(int i = 0; i <= uSteps; i++){
+    float R[4][3], D[4][3];
+    foldRow(cp, float(i) / uSteps, R, D);
+    for(int m = 0; m < w.padded; m += 8){
+      __m256 p[3], du[3], dv[3];
+      for(int l = 0; l < 3; l++){
+        p[l] = du[l] = dv[l] = _mm256_setzero_ps( );
+      }
+      for(int j = 0; j < 4; j++){
+        __m256 b = _mm256_loadu_ps(&w.b[j][m]);
+        __m256 db = _mm256_loadu_ps(&w.db[j][m]);
+        for(int l = 0; l < 3; l++){
+          p[l] = _mm256_fmadd_ps(b, _mm256_set1_ps(R[j][l]), p[l]);
+          du[l] = _mm256_fmadd_ps(b, _mm256_set1_ps(D[j][l]), du[l]);
+          dv[l] = _mm256_fmadd_ps(db, _mm256_set1_ps(R[j][l]), dv[l]);
+        }
+      }
+      __m256 nx = _mm256_fmsub_ps(du[1], dv[2], _mm256_mul_ps(du[2], dv[1]));
+      __m256 ny = _mm256_fmsub_ps(du[2], dv[0], _mm256_mul_ps(du[0], dv[2]));
+      __m256 nz = _mm256_fmsub_ps(du[0], dv[1], _mm256_mul_ps(du[1], dv[0]));
+      __m256 length = _mm256_sqrt_ps(_mm256_fmadd_ps(nz, nz, _mm256_fmadd_ps(ny, ny, _mm256_mul_ps(nx, nx))));
+      __m256 nonzero = _mm256_cmp_ps(length, _mm256_setzero_ps( ), _CMP_GT_OQ);
+      __m256 inverse = _mm256_and_ps(nonzero, _mm256_div_ps(_mm256_set1_ps(1.0f), length));
+      _mm256_storeu_ps(&row.c[0][m], p[0]);
+      _mm256_storeu_ps(&row.c[1][m], p[1]);
+      _mm256_storeu_ps(&row.c[2][m], p[2]);
+      _mm256_storeu_ps(&row.c[3][m], _mm256_mul_ps(nx, inverse));
+      _mm256_storeu_ps(&row.c[4][m], _mm256_mul_ps(ny, inverse));
+      _mm256_storeu_ps(&row.c[5][m], _mm256_mul_ps(nz, inverse));
+      _mm256_storeu_ps(&row.c[6][m], length);
+    }
+    storeRow(cp, uSteps, vSteps, i, row, vertices);
+  }
+}
+
+static bool hasAVX2( ){
+  static bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  return avx2;
+}
+
+void tessellatePatch(const float cp[4][4][3], int uSteps, int vSteps, float* vertices){
+  if(hasAVX2( )){
+    tessellatePatchAVX2(cp, uSteps, vSteps, vertices);
+  }else{
+    tessellatePatchSSE2(cp, uSteps, vSteps, vertices);
+  }
+}
+
+const char* tessellateKernelName( ){
+  return hasAVX2( ) ? "AVX2" : "SSE2";
+}
+
+#else
+
+void tessellatePatch(const float cp[4][4][3], int uSteps, int vSteps, float* vertices){
+  tessellatePatchScalar(cp, uSteps, vSteps, vertices);
+}
+
+const char* tessellateKernelName( ){
+  return "scalar";
+}
+
+#endif
+
+void tessellatePatch(const float cp[4][4][3], int grid, float* vertices){
+  tessellatePatch(cp, grid, grid, vertices);
+}
+
+static float length3(const float v[3]){
+  return sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+}
+
+// Bounds on the lengths of the second derivatives P_uu, P_uv and P_vv
+// over the patch, from the differences of its control points.
+static void secondDerivativeBounds(const float cp[4][4][3], float& uu, float& uv, float& vv){
+  uu = uv = vv = 0.0f;
+  for(int j = 0; j < 4; j++){
+    for(int k = 0; k < 4; k++){
+      float d[3];
+      if(k < 2){
+        for(int l = 0; l < 3; l++){
+          d[l] = cp[j][k + 2][l] - 2.0f * cp[j][k + 1][l] + cp[j][k][l];
+        }
+        uu = std::max(uu, 6.0f * length3(d));
+      }
+      if(j < 2){
+        for(int l = 0; l < 3; l++){
+          d[l] = cp[j + 2][k][l] - 2.0f * cp[j + 1][k][l] + cp[j][k][l];
+        }
+        vv = std::max(vv, 6.0f * length3(d));
+      }
+      if(j < 3 && k < 3){
+        for(int l = 0; l < 3; l++){
+          d[l] = cp[j + 1][k + 1][l] - cp[j + 1][k][l] - cp[j][k + 1][l] + cp[j][k][l];
+        }
+        uv = std::max(uv, 9.0f * length3(d));
+      }
+    }
+  }
+}
+
+static float flatnessBound(float uu, float uv, float vv, int uSteps, int vSteps){
+  float h = 1.0f / uSteps;
+  float k = 1.0f / vSteps;
+  return 0.125f * (h * h * uu + 2.0f * h * k * uv + k * k * vv);
+}
+
+float flatnessBound(const float cp[4][4][3], int uSteps, int vSteps){
+  float uu, uv, vv;
+  secondDerivativeBounds(cp, uu, uv, vv);
+  return flatnessBound(uu, uv, vv, uSteps, vSteps);
+}
+
+// Whether a triangle of the uSteps x vSteps lattice turns its back on
+// the normals at its corners, as one step across a tight curl does.
+// Each cell is split as glEvalMesh2's quad strips split it, the
+// triangles winding like dP/du x dP/dv.
+static bool folds(const float cp[4][4][3], int uSteps, int vSteps){
+  int side = vSteps + 1;
+  std::vector<float> lattice(size_t(uSteps + 1) * side * TESSELLATE_VERTEX_FLOATS);
+  tessellatePatch(cp, uSteps, vSteps, &lattice[0]);
+  for(int i = 0; i < uSteps; i++){
+    for(int j = 0; j < vSteps; j++){
+      int a = i * side + j;
+      int b = a + side;
+      int triangles[2][3] = {{a, b, a + 1}, {a + 1, b, b + 1}};
+      for(int t = 0; t < 2; t++){
+        const float* p[3];
+        for(int c = 0; c < 3; c++){
+          p[c] = &lattice[size_t(triangles[t][c]) * TESSELLATE_VERTEX_FLOATS];
+        }
+        float e1[3] = {p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2]};
+        float e2[3] = {p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2]};
+        float face[3];
+        cross(e1, e2, face);
+        float area = length3(face);
+        // triangles collapsed at a pole face nowhere
+        if(area <= 1e-6f){
+          continue;
+        }
+        float sum[3] = {0.0f, 0.0f, 0.0f};
+        for(int c = 0; c < 3; c++){
+          for(int l = 0; l < 3; l++){
+            sum[l] += p[c][3 + l];
+          }
+        }
+        float dot = face[0] * sum[0] + face[1] * sum[1] + face[2] * sum[2];
+        if(dot < -0.01f * area * length3(sum)){
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+// Whether boundary curve a is curve b, in either direction.
+static bool sameEdge(const float a[4][3], const float b[4][3]){
+  bool forward = true;
+  bool backward = true;
+  for(int k = 0; k < 4; k++){
+    for(int l = 0; l < 3; l++){
+      forward = forward && std::fabs(a[k][l] - b[k][l]) <= 1e-5f;
+      backward = backward && std::fabs(a[k][l] - b[3 - k][l]) <= 1e-5f;
+    }
+  }
+  return forward || backward;
+}
+
+static int findClass(std::vector<int>& parent, int n){
+  while(parent[n] != n){
+    n = parent[n] = parent[parent[n]];
+  }
+  return n;
+}
+
+void adaptivePatchSteps(const float (*patches)[4][4][3], int count, float tolerance, int maxSteps, int* uSteps, int* vSteps){
+  std::vector<float> uu(count), uv(count), vv(count);
+  // node 2n stands for the steps along u of patch n, 2n + 1 along v
+  std::vector<int> steps(2 * count);
+  for(int n = 0; n < count; n++){
+    secondDerivativeBounds(patches[n], uu[n], uv[n], vv[n]);
+    int best = maxSteps * maxSteps + 1;
+    steps[2 * n] = steps[2 * n + 1] = maxSteps;
+    for(int u = 1; u <= maxSteps; u++){
+      for(int v = 1; v <= maxSteps && u * v < best; v++){
+        if(flatnessBound(uu[n], uv[n], vv[n], u, v) <= tolerance && !folds(patches[n], u, v)){
+          best = u * v;
+          steps[2 * n] = u;
+          steps[2 * n + 1] = v;
+        }
+      }
+    }
+  }
+
+  // the boundary curves of every patch: v = 0 and v = 1 run along u,
+  // u = 0 and u = 1 along v
+  std::vector<float> edges(count * 4 * 12);
+  std::vector<bool> degenerate(count * 4);
+  for(int n = 0; n < count; n++){
+    for(int side = 0; side < 4; side++){
+      float (*edge)[3] = (float (*)[3])&edges[(n * 4 + side) * 12];
+      for(int t = 0; t < 4; t++){
+        const float* point = (side < 2) ? patches[n][side * 3][t] : patches[n][t][(side - 2) * 3];
+        for(int l = 0; l < 3; l++){
+          edge[t][l] = point[l];
+        }
+      }
+      // a boundary collapsed to a point, such as the top of the lid,
+      // has no neighbour to match
+      float span[3] = {edge[3][0] - edge[0][0], edge[3][1] - edge[0][1], edge[3][2] - edge[0][2]};
+      float bulge[3] = {edge[1][0] - edge[0][0], edge[1][1] - edge[0][1], edge[1][2] - edge[0][2]};
+      degenerate[n * 4 + side] = length3(span) <= 1e-5f && length3(bulge) <= 1e-5f;
+    }
+  }
+  std::vector<int> parent(2 * count);
+  for(int node = 0; node < 2 * count; node++){
+    parent[node] = node;
+  }
+  for(int a = 0; a < count * 4; a++){
+    for(int b = a + 1; b < count * 4; b++){
+      if(degenerate[a] || degenerate[b] || !sameEdge((const float (*)[3])&edges[a * 12], (const float (*)[3])&edges[b * 12])){
+        continue;
+      }
+      int nodeA = 2 * (a / 4) + ((a % 4) < 2 ? 0 : 1);
+      int nodeB = 2 * (b / 4) + ((b % 4) < 2 ? 0 : 1);
+      parent[findClass(parent, nodeA)] = findClass(parent, nodeB);
+    }
+  }
+
+  // every edge of a class gets the most steps any of its patches asks
+  // for, then classes give back steps while every patch stays flat and
+  // unfolded
+  std::vector<int> classSteps(2 * count, 0);
+  for(int node = 0; node < 2 * count; node++){
+    int c = findClass(parent, node);
+    classSteps[c] = std::max(classSteps[c], steps[node]);
+  }
+  // more steps along one side than a patch chose can fold it again:
+  // add steps along its other side until it lies flat
+  bool raised = true;
+  while(raised){
+    raised = false;
+    for(int n = 0; n < count; n++){
+      int& u = classSteps[findClass(parent, 2 * n)];
+      int& v = classSteps[findClass(parent, 2 * n + 1)];
+      if((u < maxSteps || v < maxSteps) && folds(patches[n], u, v)){
+        int& fewer = (v >= maxSteps || (u <= v && u < maxSteps)) ? u : v;
+        fewer++;
+        raised = true;
+      }
+    }
+  }
+  bool lowered = true;
+  while(lowered){
+    lowered = false;
+    for(int c = 0; c < 2 * count; c++){
+      if(findClass(parent, c) != c || classSteps[c] <= 1){
+        continue;
+      }
+      bool flat = true;
+      for(int n = 0; n < count && flat; n++){
+        int u = classSteps[findClass(parent, 2 * n)];
+        int v = classSteps[findClass(parent, 2 * n + 1)];
+        if(findClass(parent, 2 * n) == c){
+          u--;
+        }
+        if(findClass(parent, 2 * n + 1) == c){
+          v--;
+        }
+        if(u != classSteps[findClass(parent, 2 * n)] || v != classSteps[findClass(parent, 2 * n + 1)]){
+          flat = flatnessBound(uu[n], uv[n], vv[n], u, v) <= tolerance && !folds(patches[n], u, v);
+        }
+      }
+      if(flat){
+        classSteps[c]--;
+        lowered = true;
+      }
+    }
+  }
+  for(int n = 0; n < count; n++){
+    uSteps[n] = classSteps[findClass(parent, 2 * n)];
+    vSteps[n] = classSteps[findClass(parent, 2 * n + 1)];
+  }
+}
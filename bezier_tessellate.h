@@ -0,0 +1,51 @@
+//
+// CPU tessellation of bicubic Bezier patches.
+//
+//
+
+#include <cstddef>
+
+#ifndef _BEZIER_TESSELLATE_H_
+#define _BEZIER_TESSELLATE_H_
+
+// Floats written per vertex: a position, then a unit normal.
+static const int TESSELLATE_VERTEX_FLOATS = 6;
+
+// Evaluate the patch with control points cp on a (uSteps + 1) x
+// (vSteps + 1) lattice of parameters and write the interleaved
+// vertices to vertices. The layout of cp is the one glMap2f is given
+// with a u stride of 3 and a v stride of 12: u weighs cp[.][k] and v
+// weighs cp[j][.]. Vertex i * (vSteps + 1) + j is at u = i / uSteps
+// and v = j / vSteps and its normal is dP/du x dP/dv, as
+// GL_AUTO_NORMAL computes it; where the patch collapses to a point
+// the normal is taken from just inside it. Dispatches to the widest
+// kernel the CPU supports.
+void tessellatePatch(const float cp[4][4][3], int uSteps, int vSteps, float* vertices);
+
+// The same on the (grid + 1) x (grid + 1) lattice glEvalMesh2 uses.
+void tessellatePatch(const float cp[4][4][3], int grid, float* vertices);
+
+void tessellatePatchScalar(const float cp[4][4][3], int uSteps, int vSteps, float* vertices);
+
+#if defined(__x86_64__) || defined(__i386__)
+// Four vertices of a row per iteration.
+void tessellatePatchSSE2(const float cp[4][4][3], int uSteps, int vSteps, float* vertices);
+
+// Eight vertices of a row per iteration.
+void tessellatePatchAVX2(const float cp[4][4][3], int uSteps, int vSteps, float* vertices);
+#endif
+
+// An upper bound on the distance between the patch and the triangles
+// of its uSteps x vSteps lattice.
+float flatnessBound(const float cp[4][4][3], int uSteps, int vSteps);
+
+// Steps along u and v for each of count patches, at most maxSteps,
+// that keep every patch's flatnessBound( ) within tolerance with few
+// triangles, none of them folded over against the patch's normals. Patches sharing a boundary curve get the same steps
+// along it, so their lattices meet vertex to vertex without cracks.
+void adaptivePatchSteps(const float (*patches)[4][4][3], int count, float tolerance, int maxSteps, int* uSteps, int* vSteps);
+
+// The name of the kernel tessellatePatch dispatches to.
+const char* tessellateKernelName( );
+
+#endif
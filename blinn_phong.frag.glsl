@@ -17,6 +17,7 @@
 
 varying vec3 myNormal;
 varying vec4 myVertex;
+varying float myMaterial;
 
 // These are passed in from the CPU program
 uniform mat4 modelViewMatrix;
@@ -32,14 +33,30 @@ uniform vec4 ambient;
 uniform vec4 diffuse;
 uniform vec4 specular;
 uniform float shininess;
+// With useMaterialTable set the material is instead entry myMaterial
+// of materialTable (MaterialTable.h), four texels per material.
+uniform bool useMaterialTable;
+uniform sampler2D materialTable;
+uniform vec2 materialTableSize;
+
+// The material of the fragment being shaded.
+vec4 materialAmbient;
+vec4 materialDiffuse;
+vec4 materialSpecular;
+float materialShininess;
+
+vec4 materialTexel(const in float texel){
+  vec2 at = vec2(mod(texel, materialTableSize.x), floor(texel / materialTableSize.x)) + 0.5;
+  return texture2D(materialTable, at / materialTableSize);
+}
 
 vec4 computeLight(const in vec3 direction, const in vec4 lightcolor, const in vec3 normal, const in vec3 reflection){
 
   float nDotL = dot(normal, direction);
-  vec4 lambert = diffuse * lightcolor * max(nDotL, 0.0);
+  vec4 lambert = materialDiffuse * lightcolor * max(nDotL, 0.0);
 
   float nDotR = dot(normal, reflection);
-  vec4 phong = specular * lightcolor * pow(max(nDotR, 0.0), shininess);
+  vec4 phong = materialSpecular * lightcolor * pow(max(nDotR, 0.0), materialShininess);
 
   vec4 retval = lambert + phong;
   return retval;
@@ -47,6 +64,21 @@ vec4 computeLight(const in vec3 direction, const in vec4 lightcolor, const in ve
 
 void main (void){
 
+  if(useMaterialTable){
+    // the index is the same at every vertex, but rounded in case
+    // interpolation strays from it
+    float first = floor(myMaterial + 0.5) * 4.0;
+    materialAmbient = materialTexel(first);
+    materialDiffuse = materialTexel(first + 1.0);
+    materialSpecular = materialTexel(first + 2.0);
+    materialShininess = materialTexel(first + 3.0).x;
+  }else{
+    materialAmbient = ambient;
+    materialDiffuse = diffuse;
+    materialSpecular = specular;
+    materialShininess = shininess;
+  }
+
   // They eye is always at (0,0,0) looking down -z axis 
   // Also compute current fragment position and direction to eye 
 
@@ -73,5 +105,5 @@ void main (void){
 
   vec4 color1 = computeLight(direction1, light1_color, normal, half1) ;
     
-  gl_FragColor = ambient + color0 + color1;
+  gl_FragColor = materialAmbient + color0 + color1;
 }
@@ -19,14 +19,53 @@
 uniform mat4 modelViewMatrix;
 uniform mat4 projectionMatrix;
 
+// Packed meshes (MeshBuffer.h) send 16 bit positions within their
+// bounds in gl_Vertex and octahedral normals in packedNormal.
+uniform bool packedVertices;
+uniform vec3 packedOffset;
+uniform vec3 packedScale;
+attribute vec2 packedNormal;
+// Signs reflecting a teapot mesh into the other quadrants.
+uniform vec3 mirror;
+// Instanced teapots (InstanceBuffer.h) are scaled by instancePosition.w
+// and moved to instancePosition.xyz here; the modelview matrix is then
+// the view matrix alone. instanceMaterial, per instance or set once
+// per draw, indexes the material table.
+uniform bool instanced;
+attribute vec4 instancePosition;
+attribute float instanceMaterial;
+
 
 // These are variables that we wish to send to our fragment shader
 // In later versions of GLSL, these are 'out' variables.
 varying vec3 myNormal;
 varying vec4 myVertex;
+varying float myMaterial;
+
+// Unfold a normal from the octahedron, snorm values in [-1, 1].
+vec3 octahedralNormal(vec2 e){
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  if(n.z < 0.0){
+    vec2 signs = vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+    n.xy = (1.0 - abs(e.yx)) * signs;
+  }
+  return normalize(n);
+}
 
 void main() {
-  gl_Position = projectionMatrix * modelViewMatrix * gl_Vertex;
-  myNormal = gl_Normal;
-  myVertex = gl_Vertex;
+  vec4 vertex = gl_Vertex;
+  vec3 normal = gl_Normal;
+  if(packedVertices){
+    vertex = vec4(packedOffset + packedScale * max(gl_Vertex.xyz / 32767.0, -1.0), 1.0);
+    normal = octahedralNormal(max(packedNormal / 32767.0, -1.0));
+  }
+  vertex.xyz *= mirror;
+  normal *= mirror;
+  if(instanced){
+    vertex.xyz = vertex.xyz * instancePosition.w + instancePosition.xyz;
+  }
+  myMaterial = instanceMaterial;
+  gl_Position = projectionMatrix * modelViewMatrix * vertex;
+  myNormal = normal;
+  myVertex = vertex;
 }
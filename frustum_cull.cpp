@@ -0,0 +1,195 @@
+//
+// Batch bounding sphere versus frustum culling kernels.
+//
+// The instances are kept as separate x, y, z and radius arrays so a
+// SIMD register holds the same component of several spheres. Each
+// plane is broadcast once and the plane distance of 8 (AVX2) or
+// 4 (SSE2) spheres is computed at a time; the per-lane results are
+// folded into the visibility bitmask with movemask.
+//
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "frustum_cull.h"
+
+static void clearMasks(size_t count, uint32_t* visibleMask, uint32_t* insideMask){
+  size_t words = (count + 31) / 32;
+  memset(visibleMask, 0, words * sizeof(uint32_t));
+  if(insideMask){
+    memset(insideMask, 0, words * sizeof(uint32_t));
+  }
+}
+
+// Sets the bits of spheres [begin, end); the masks must be cleared.
+static void cullRangeScalar(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t begin, size_t end, uint32_t* visibleMask, uint32_t* insideMask){
+  for(size_t i = begin; i < end; i++){
+    Frustum::containment_t c = frustum.classifySphere(glm::vec3(x[i], y[i], z[i]), r[i]);
+    uint32_t bit = uint32_t(1) << (i & 31);
+    if(c != Frustum::OUTSIDE){
+      visibleMask[i >> 5] |= bit;
+    }
+    if(insideMask && c == Frustum::INSIDE){
+      insideMask[i >> 5] |= bit;
+    }
+  }
+}
+
+void frustumCullSpheresScalar(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint32_t* visibleMask, uint32_t* insideMask){
+  clearMasks(count, visibleMask, insideMask);
+  cullRangeScalar(frustum, x, y, z, r, 0, count, visibleMask, insideMask);
+}
+
+uint64_t frustumCullSpheresCoherent(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint8_t* lastPlane, uint32_t* visibleMask, uint32_t* insideMask){
+  uint64_t tests = 0;
+  clearMasks(count, visibleMask, insideMask);
+  for(size_t i = 0; i < count; i++){
+    glm::vec3 c(x[i], y[i], z[i]);
+    int first = lastPlane[i];
+    tests++;
+    float d = frustum.distance(first, c);
+    if(d < -r[i]){
+      continue;
+    }
+    bool inside = (d >= r[i]);
+    bool outside = false;
+    for(int p = 0; p < Frustum::PLANE_COUNT; p++){
+      if(p == first){
+        continue;
+      }
+      tests++;
+      d = frustum.distance(p, c);
+      if(d < -r[i]){
+        lastPlane[i] = uint8_t(p);
+        outside = true;
+        break;
+      }
+      inside = inside && (d >= r[i]);
+    }
+    if(outside){
+      continue;
+    }
+    uint32_t bit = uint32_t(1) << (i & 31);
+    visibleMask[i >> 5] |= bit;
+    if(insideMask && inside){
+      insideMask[i >> 5] |= bit;
+    }
+  }
+  return tests;
+}
+
+size_t compactVisible(const uint32_t* visibleMask, size_t count, uint32_t* indices){
+  size_t words = (count + 31) / 32;
+  size_t n = 0;
+  for(size_t w = 0; w < words; w++){
+    uint32_t bits = visibleMask[w];
+    // mostly empty words when few instances are visible
+    while(bits){
+      indices[n++] = uint32_t(w * 32 + __builtin_ctz(bits));
+      bits &= bits - 1;
+    }
+  }
+  return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+void frustumCullSpheresSSE2(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint32_t* visibleMask, uint32_t* insideMask){
+  __m128 pa[Frustum::PLANE_COUNT], pb[Frustum::PLANE_COUNT], pc[Frustum::PLANE_COUNT], pd[Frustum::PLANE_COUNT];
+  for(int p = 0; p < Frustum::PLANE_COUNT; p++){
+    pa[p] = _mm_set1_ps(frustum.planes[p].x);
+    pb[p] = _mm_set1_ps(frustum.planes[p].y);
+    pc[p] = _mm_set1_ps(frustum.planes[p].z);
+    pd[p] = _mm_set1_ps(frustum.planes[p].w);
+  }
+  const __m128 signMask = _mm_set1_ps(-0.0f);
+  clearMasks(count, visibleMask, insideMask);
+  size_t n = count & ~size_t(3);
+  for(size_t i = 0; i < n; i += 4){
+    __m128 vx = _mm_loadu_ps(x + i);
+    __m128 vy = _mm_loadu_ps(y + i);
+    __m128 vz = _mm_loadu_ps(z + i);
+    __m128 vr = _mm_loadu_ps(r + i);
+    __m128 negR = _mm_xor_ps(vr, signMask);
+    __m128 visible = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    __m128 inside = visible;
+    for(int p = 0; p < Frustum::PLANE_COUNT; p++){
+      __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pa[p], vx), _mm_mul_ps(pb[p], vy)),
+                            _mm_add_ps(_mm_mul_ps(pc[p], vz), pd[p]));
+      visible = _mm_and_ps(visible, _mm_cmpge_ps(d, negR));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(d, vr));
+    }
+    uint32_t shift = i & 31;
+    visibleMask[i >> 5] |= uint32_t(_mm_movemask_ps(visible)) << shift;
+    if(insideMask){
+      insideMask[i >> 5] |= uint32_t(_mm_movemask_ps(inside)) << shift;
+    }
+  }
+  cullRangeScalar(frustum, x, y, z, r, n, count, visibleMask, insideMask);
+}
+
+__attribute__((target("avx2,fma")))
+void frustumCullSpheresAVX2(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint32_t* visibleMask, uint32_t* insideMask){
+  __m256 pa[Frustum::PLANE_COUNT], pb[Frustum::PLANE_COUNT], pc[Frustum::PLANE_COUNT], pd[Frustum::PLANE_COUNT];
+  for(int p = 0; p < Frustum::PLANE_COUNT; p++){
+    pa[p] = _mm256_set1_ps(frustum.planes[p].x);
+    pb[p] = _mm256_set1_ps(frustum.planes[p].y);
+    pc[p] = _mm256_set1_ps(frustum.planes[p].z);
+    pd[p] = _mm256_set1_ps(frustum.planes[p].w);
+  }
+  const __m256 signMask = _mm256_set1_ps(-0.0f);
+  clearMasks(count, visibleMask, insideMask);
+  size_t n = count & ~size_t(7);
+  for(size_t i = 0; i < n; i += 8){
+    __m256 vx = _mm256_loadu_ps(x + i);
+    __m256 vy = _mm256_loadu_ps(y + i);
+    __m256 vz = _mm256_loadu_ps(z + i);
+    __m256 vr = _mm256_loadu_ps(r + i);
+    __m256 negR = _mm256_xor_ps(vr, signMask);
+    __m256 visible = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    __m256 inside = visible;
+    for(int p = 0; p < Frustum::PLANE_COUNT; p++){
+      __m256 d = _mm256_fmadd_ps(pa[p], vx, _mm256_fmadd_ps(pb[p], vy, _mm256_fmadd_ps(pc[p], vz, pd[p])));
+      visible = _mm256_and_ps(visible, _mm256_cmp_ps(d, negR, _CMP_GE_OQ));
+      inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, vr, _CMP_GE_OQ));
+    }
+    uint32_t shift = i & 31;
+    visibleMask[i >> 5] |= uint32_t(_mm256_movemask_ps(visible)) << shift;
+    if(insideMask){
+      insideMask[i >> 5] |= uint32_t(_mm256_movemask_ps(inside)) << shift;
+    }
+  }
+  cullRangeScalar(frustum, x, y, z, r, n, count, visibleMask, insideMask);
+}
+
+static bool hasAVX2( ){
+  static bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  return avx2;
+}
+
+void frustumCullSpheres(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint32_t* visibleMask, uint32_t* insideMask){
+  if(hasAVX2( )){
+    frustumCullSpheresAVX2(frustum, x, y, z, r, count, visibleMask, insideMask);
+  }else{
+    frustumCullSpheresSSE2(frustum, x, y, z, r, count, visibleMask, insideMask);
+  }
+}
+
+const char* frustumCullKernelName( ){
+  return hasAVX2( ) ? "AVX2" : "SSE2";
+}
+
+#else
+
+void frustumCullSpheres(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint32_t* visibleMask, uint32_t* insideMask){
+  frustumCullSpheresScalar(frustum, x, y, z, r, count, visibleMask, insideMask);
+}
+
+const char* frustumCullKernelName( ){
+  return "scalar";
+}
+
+#endif
@@ -0,0 +1,44 @@
+//
+// Batch bounding sphere versus frustum culling kernels.
+//
+//
+
+#include <cstddef>
+#include <stdint.h>
+
+#include "Frustum.h"
+
+#ifndef _FRUSTUM_CULL_H_
+#define _FRUSTUM_CULL_H_
+
+// Test count spheres (x[i], y[i], z[i], r[i]) against the frustum and
+// set bit i of visibleMask and insideMask. Both masks hold
+// (count + 31) / 32 words and are overwritten. insideMask may be NULL.
+// Dispatches to the widest kernel the CPU supports.
+void frustumCullSpheres(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint32_t* visibleMask, uint32_t* insideMask);
+
+void frustumCullSpheresScalar(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint32_t* visibleMask, uint32_t* insideMask);
+
+#if defined(__x86_64__) || defined(__i386__)
+// Four spheres per iteration.
+void frustumCullSpheresSSE2(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint32_t* visibleMask, uint32_t* insideMask);
+
+// Eight spheres per iteration.
+void frustumCullSpheresAVX2(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint32_t* visibleMask, uint32_t* insideMask);
+#endif
+
+// Like frustumCullSpheresScalar but first tests, for every sphere, the
+// plane that rejected it last time. lastPlane holds one plane index per
+// sphere and is updated whenever a different plane rejects it. Returns
+// the number of sphere/plane tests made.
+uint64_t frustumCullSpheresCoherent(const Frustum& frustum, const float* x, const float* y, const float* z, const float* r, size_t count, uint8_t* lastPlane, uint32_t* visibleMask, uint32_t* insideMask);
+
+// Stream compaction of a visibility mask: write the index of every set
+// bit among the first count into indices, in increasing order, and
+// return how many there were. indices must have room for count.
+size_t compactVisible(const uint32_t* visibleMask, size_t count, uint32_t* indices);
+
+// The name of the kernel frustumCullSpheres dispatches to.
+const char* frustumCullKernelName( );
+
+#endif
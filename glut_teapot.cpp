@@ -51,6 +51,7 @@ OpenGL(TM) is a trademark of Silicon Graphics, Inc.
 */
 
 //#include "glutint.h"
+#include <math.h>
 #include "glut_teapot.h"
 
 #ifdef __cplusplus 
@@ -205,6 +206,105 @@ teapot(GLint grid, GLdouble scale, GLenum type)
   glPopAttrib();
 }
 
+/* Control point j of patch i under reflection m: bit 0 negates y,
+   bit 1 negates x. Only the first six patches are reflected in x. */
+static void
+mirroredControlPoint(long i, long j, long m, float v[3])
+{
+  long l;
+
+  for (l = 0; l < 3; l++) {
+    v[l] = cpdata[patchdata[i][j]][l];
+  }
+  if (m & 1)
+    v[1] *= -1.0;
+  if (m & 2)
+    v[0] *= -1.0;
+}
+
+/* The control points of the n-th of the 32 patches drawn by teapot(),
+   in the same order and layout as the arrays handed to glMap2f: each
+   of the 10 patches, then its reflection in y and, for the first six,
+   its reflections in x and in both. */
+static void
+teapotPatch(long n, float cp[4][4][3])
+{
+  long i, j, k, m, flip;
+
+  i = (n < 24) ? n / 4 : 6 + (n - 24) / 2;
+  m = (n < 24) ? n % 4 : (n - 24) % 2;
+  /* a single reflection flips the patch; turn it back around in u */
+  flip = (m == 1 || m == 2);
+  for (j = 0; j < 4; j++) {
+    for (k = 0; k < 4; k++) {
+      mirroredControlPoint(i, j * 4 + (flip ? 3 - k : k), m, cp[j][k]);
+    }
+  }
+}
+
+/* The control points of the i-th of the 10 patches before any
+   reflection. Returns how many copies teapot() draws of it: 4, itself
+   and its reflections in y, x and both, for the rim, body, lid and
+   bottom, 2, itself and its reflection in y, for the handle and
+   spout. */
+static long
+uniquePatch(long i, float cp[4][4][3])
+{
+  long j, k;
+
+  for (j = 0; j < 4; j++) {
+    for (k = 0; k < 4; k++) {
+      mirroredControlPoint(i, j * 4 + k, 0, cp[j][k]);
+    }
+  }
+  return (i < 6) ? 4 : 2;
+}
+
+/* The bounding sphere of the control points of all reflected patches,
+   in the coordinates handed to the evaluator (before the rotate,
+   scale and translate in teapot()). The surface lies inside the convex
+   hull of its control points, so the sphere encloses the teapot. */
+static void
+teapotBounds(GLfloat center[3], GLfloat *radius)
+{
+  float lo[3], hi[3], v[3], d, r2;
+  long i, j, l, m;
+
+  mirroredControlPoint(0, 0, 0, lo);
+  mirroredControlPoint(0, 0, 0, hi);
+  for (i = 0; i < 10; i++) {
+    for (m = 0; m < ((i < 6) ? 4 : 2); m++) {
+      for (j = 0; j < 16; j++) {
+        mirroredControlPoint(i, j, m, v);
+        for (l = 0; l < 3; l++) {
+          if (v[l] < lo[l])
+            lo[l] = v[l];
+          if (v[l] > hi[l])
+            hi[l] = v[l];
+        }
+      }
+    }
+  }
+  for (l = 0; l < 3; l++) {
+    center[l] = 0.5 * (lo[l] + hi[l]);
+  }
+  r2 = 0.0;
+  for (i = 0; i < 10; i++) {
+    for (m = 0; m < ((i < 6) ? 4 : 2); m++) {
+      for (j = 0; j < 16; j++) {
+        mirroredControlPoint(i, j, m, v);
+        d = 0.0;
+        for (l = 0; l < 3; l++) {
+          d += (v[l] - center[l]) * (v[l] - center[l]);
+        }
+        if (d > r2)
+          r2 = d;
+      }
+    }
+  }
+  *radius = sqrt(r2);
+}
+
 /* CENTRY */
 void GLUTAPIENTRY 
 _glutSolidTeapot(GLdouble scale)
@@ -212,12 +312,48 @@ _glutSolidTeapot(GLdouble scale)
   teapot(7, scale, GL_FILL);
 }
 
+void GLUTAPIENTRY
+_glutSolidTeapotGrid(GLint grid, GLdouble scale)
+{
+  teapot(grid, scale, GL_FILL);
+}
+
 void GLUTAPIENTRY 
 _glutWireTeapot(GLdouble scale)
 {
   teapot(10, scale, GL_LINE);
 }
 
+void GLUTAPIENTRY
+_glutTeapotBoundingSphere(GLfloat center[3], GLfloat *radius)
+{
+  teapotBounds(center, radius);
+}
+
+int GLUTAPIENTRY
+_glutTeapotPatchCount(void)
+{
+  return 32;
+}
+
+void GLUTAPIENTRY
+_glutTeapotPatch(int n, GLfloat cp[4][4][3])
+{
+  teapotPatch(n, cp);
+}
+
+int GLUTAPIENTRY
+_glutTeapotUniquePatchCount(void)
+{
+  return 10;
+}
+
+int GLUTAPIENTRY
+_glutTeapotUniquePatch(int i, GLfloat cp[4][4][3])
+{
+  return uniquePatch(i, cp);
+}
+
 /* ENDCENTRY */
 #ifdef __cplusplus
 }
@@ -34,8 +34,20 @@ extern "C" {
 
 void _glutSolidTeapot(GLdouble scale);
 
+void _glutSolidTeapotGrid(GLint grid, GLdouble scale);
+
 void _glutWireTeapot(GLdouble scale);
 
+void _glutTeapotBoundingSphere(GLfloat center[3], GLfloat *radius);
+
+int _glutTeapotPatchCount(void);
+
+void _glutTeapotPatch(int n, GLfloat cp[4][4][3]);
+
+int _glutTeapotUniquePatchCount(void);
+
+int _glutTeapotUniquePatch(int i, GLfloat cp[4][4][3]);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,285 @@
+//
+// Index and vertex buffer reordering for the post-transform vertex
+// cache, overdraw and vertex fetch.
+//
+// optimizeVertexCache( ) follows Tom Forsyth's "Linear-Speed Vertex
+// Cache Optimisation": every vertex is scored by its position in a
+// simulated LRU cache and by how many of its triangles are still to
+// be drawn, every triangle by the sum of its vertices' scores, and
+// the best triangle among those touching the cache is drawn next.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "mesh_optimize.h"
+
+size_t weldVertices(float* vertices, size_t vertexCount, int floatsPerVertex, uint32_t* indices, size_t indexCount, float tolerance){
+  // the kept vertices by the cell of the tolerance grid their position
+  // falls in; a vertex within tolerance of one lies in the same or a
+  // neighbouring cell, whichever side of a cell boundary it rounds to
+  typedef std::tuple<long, long, long> cell_t;
+  std::map<cell_t, std::vector<uint32_t> > cells;
+  std::vector<uint32_t> remap(vertexCount);
+  size_t kept = 0;
+  for(size_t v = 0; v < vertexCount; v++){
+    const float* f = vertices + v * floatsPerVertex;
+    long cx = lroundf(f[0] / tolerance);
+    long cy = lroundf(f[1] / tolerance);
+    long cz = lroundf(f[2] / tolerance);
+    bool welded = false;
+    for(long dx = -1; dx <= 1 && !welded; dx++){
+      for(long dy = -1; dy <= 1 && !welded; dy++){
+        for(long dz = -1; dz <= 1 && !welded; dz++){
+          std::map<cell_t, std::vector<uint32_t> >::const_iterator found = cells.find(cell_t(cx + dx, cy + dy, cz + dz));
+          if(found == cells.end( )){
+            continue;
+          }
+          for(size_t k = 0; k < found->second.size( ) && !welded; k++){
+            const float* g = vertices + size_t(found->second[k]) * floatsPerVertex;
+            welded = true;
+            for(int l = 0; l < floatsPerVertex && welded; l++){
+              welded = fabsf(f[l] - g[l]) <= tolerance;
+            }
+            if(welded){
+              remap[v] = found->second[k];
+            }
+          }
+        }
+      }
+    }
+    if(welded){
+      continue;
+    }
+    remap[v] = uint32_t(kept);
+    cells[cell_t(cx, cy, cz)].push_back(uint32_t(kept));
+    if(kept != v){
+      memmove(vertices + kept * floatsPerVertex, f, floatsPerVertex * sizeof(float));
+    }
+    kept++;
+  }
+  for(size_t k = 0; k < indexCount; k++){
+    indices[k] = remap[indices[k]];
+  }
+  return kept;
+}
+
+// Forsyth's scoring constants.
+static const float cacheDecayPower = 1.5f;
+static const float lastTriangleScore = 0.75f;
+static const float valenceBoostScale = 2.0f;
+static const float valenceBoostPower = 0.5f;
+
+static float vertexScore(int cachePosition, unsigned int cacheSize, unsigned int remaining){
+  if(remaining == 0){
+    return -1.0f;
+  }
+  float score = 0.0f;
+  if(cachePosition >= 0){
+    if(cachePosition < 3){
+      // the vertices of the triangle just drawn
+      score = lastTriangleScore;
+    }else{
+      float scale = 1.0f / (cacheSize - 3);
+      score = powf(1.0f - (cachePosition - 3) * scale, cacheDecayPower);
+    }
+  }
+  return score + valenceBoostScale * powf(float(remaining), -valenceBoostPower);
+}
+
+void optimizeVertexCache(uint32_t* indices, size_t indexCount, size_t vertexCount, unsigned int cacheSize){
+  size_t triangleCount = indexCount / 3;
+  if(triangleCount == 0){
+    return;
+  }
+  cacheSize = std::max(cacheSize, 4u);
+
+  // the triangles of every vertex, as offsets into one array
+  std::vector<unsigned int> remaining(vertexCount, 0);
+  for(size_t k = 0; k < indexCount; k++){
+    remaining[indices[k]]++;
+  }
+  std::vector<size_t> firstTriangle(vertexCount + 1, 0);
+  for(size_t v = 0; v < vertexCount; v++){
+    firstTriangle[v + 1] = firstTriangle[v] + remaining[v];
+  }
+  std::vector<uint32_t> vertexTriangles(indexCount);
+  std::vector<size_t> filled(firstTriangle.begin( ), firstTriangle.end( ) - 1);
+  for(size_t t = 0; t < triangleCount; t++){
+    for(int c = 0; c < 3; c++){
+      uint32_t v = indices[3 * t + c];
+      vertexTriangles[filled[v]++] = uint32_t(t);
+    }
+  }
+
+  std::vector<int> cachePosition(vertexCount, -1);
+  std::vector<float> score(vertexCount);
+  for(size_t v = 0; v < vertexCount; v++){
+    score[v] = vertexScore(-1, cacheSize, remaining[v]);
+  }
+  std::vector<float> triangleScore(triangleCount);
+  std::vector<bool> drawn(triangleCount, false);
+  for(size_t t = 0; t < triangleCount; t++){
+    triangleScore[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+  }
+
+  std::vector<uint32_t> output;
+  output.reserve(indexCount);
+  // three extra entries hold the vertices pushed out by each triangle
+  std::vector<uint32_t> cache, next;
+  cache.reserve(cacheSize + 3);
+  next.reserve(cacheSize + 3);
+  size_t best = 0;
+  for(size_t t = 1; t < triangleCount; t++){
+    if(triangleScore[t] > triangleScore[best]){
+      best = t;
+    }
+  }
+  size_t scan = 0;
+  while(true){
+    drawn[best] = true;
+    const uint32_t* triangle = indices + 3 * best;
+    output.insert(output.end( ), triangle, triangle + 3);
+
+    // the triangle's vertices move to the front of the cache
+    next.assign(triangle, triangle + 3);
+    for(size_t k = 0; k < cache.size( ); k++){
+      if(cache[k] != triangle[0] && cache[k] != triangle[1] && cache[k] != triangle[2]){
+        next.push_back(cache[k]);
+      }
+    }
+    for(int c = 0; c < 3; c++){
+      uint32_t v = triangle[c];
+      remaining[v]--;
+      // take the drawn triangle out of the vertex's list
+      size_t begin = firstTriangle[v];
+      size_t end = begin + remaining[v] + 1;
+      for(size_t k = begin; k < end; k++){
+        if(vertexTriangles[k] == best){
+          std::swap(vertexTriangles[k], vertexTriangles[end - 1]);
+          break;
+        }
+      }
+    }
+    for(size_t k = cacheSize; k < next.size( ); k++){
+      cachePosition[next[k]] = -1;
+      score[next[k]] = vertexScore(-1, cacheSize, remaining[next[k]]);
+    }
+    if(next.size( ) > cacheSize){
+      next.resize(cacheSize);
+    }
+    cache.swap(next);
+
+    // rescore the cached vertices' triangles and pick the best of them
+    for(size_t k = 0; k < cache.size( ); k++){
+      cachePosition[cache[k]] = int(k);
+      score[cache[k]] = vertexScore(int(k), cacheSize, remaining[cache[k]]);
+    }
+    float bestScore = -1.0f;
+    bool found = false;
+    for(size_t k = 0; k < cache.size( ); k++){
+      uint32_t v = cache[k];
+      for(size_t e = firstTriangle[v]; e < firstTriangle[v] + remaining[v]; e++){
+        uint32_t t = vertexTriangles[e];
+        const uint32_t* tv = indices + 3 * t;
+        triangleScore[t] = score[tv[0]] + score[tv[1]] + score[tv[2]];
+        if(triangleScore[t] > bestScore){
+          bestScore = triangleScore[t];
+          best = t;
+          found = true;
+        }
+      }
+    }
+    if(!found){
+      // nothing in the cache has triangles left: start anew
+      while(scan < triangleCount && drawn[scan]){
+        scan++;
+      }
+      if(scan == triangleCount){
+        break;
+      }
+      best = scan;
+    }
+  }
+  std::copy(output.begin( ), output.end( ), indices);
+}
+
+size_t optimizeVertexFetch(float* vertices, size_t vertexCount, int floatsPerVertex, uint32_t* indices, size_t indexCount){
+  const uint32_t unused = ~uint32_t(0);
+  std::vector<uint32_t> remap(vertexCount, unused);
+  std::vector<float> ordered;
+  ordered.reserve(vertexCount * floatsPerVertex);
+  uint32_t next = 0;
+  for(size_t k = 0; k < indexCount; k++){
+    uint32_t v = indices[k];
+    if(remap[v] == unused){
+      remap[v] = next++;
+      ordered.insert(ordered.end( ), vertices + size_t(v) * floatsPerVertex, vertices + size_t(v + 1) * floatsPerVertex);
+    }
+    indices[k] = remap[v];
+  }
+  std::copy(ordered.begin( ), ordered.end( ), vertices);
+  return next;
+}
+
+float overdrawSortKey(const float* vertices, int floatsPerVertex, const uint32_t* indices, size_t indexCount, const float meshCenter[3]){
+  float centroid[3] = {0.0f, 0.0f, 0.0f};
+  float normal[3] = {0.0f, 0.0f, 0.0f};
+  float area = 0.0f;
+  for(size_t k = 0; k + 2 < indexCount; k += 3){
+    const float* a = vertices + size_t(indices[k]) * floatsPerVertex;
+    const float* b = vertices + size_t(indices[k + 1]) * floatsPerVertex;
+    const float* c = vertices + size_t(indices[k + 2]) * floatsPerVertex;
+    float ab[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    float ac[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    // twice the triangle's area times its unit normal
+    float n[3] = {ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2], ab[0] * ac[1] - ab[1] * ac[0]};
+    float twiceArea = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    for(int l = 0; l < 3; l++){
+      centroid[l] += (a[l] + b[l] + c[l]) / 3.0f * twiceArea;
+      normal[l] += n[l];
+    }
+    area += twiceArea;
+  }
+  float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+  if(area <= 0.0f || length <= 0.0f){
+    return 0.0f;
+  }
+  float key = 0.0f;
+  for(int l = 0; l < 3; l++){
+    key += (centroid[l] / area - meshCenter[l]) * normal[l] / length;
+  }
+  return key;
+}
+
+void analyzeVertexCache(const uint32_t* indices, size_t indexCount, size_t vertexCount, unsigned int cacheSize, float* acmr, float* atvr){
+  std::vector<bool> referenced(vertexCount, false);
+  // most recently used first, as optimizeVertexCache( ) models it
+  std::vector<uint32_t> cache;
+  cache.reserve(cacheSize + 1);
+  size_t transformed = 0;
+  size_t unique = 0;
+  for(size_t k = 0; k < indexCount; k++){
+    uint32_t v = indices[k];
+    std::vector<uint32_t>::iterator found = std::find(cache.begin( ), cache.end( ), v);
+    if(found == cache.end( )){
+      transformed++;
+      cache.insert(cache.begin( ), v);
+      if(cache.size( ) > cacheSize){
+        cache.pop_back( );
+      }
+    }else{
+      std::rotate(cache.begin( ), found, found + 1);
+    }
+    if(!referenced[v]){
+      referenced[v] = true;
+      unique++;
+    }
+  }
+  *acmr = (indexCount >= 3) ? float(transformed) / (indexCount / 3) : 0.0f;
+  *atvr = unique ? float(transformed) / unique : 0.0f;
+}
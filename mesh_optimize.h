@@ -0,0 +1,44 @@
+//
+// Index and vertex buffer reordering for the post-transform vertex
+// cache, overdraw and vertex fetch.
+//
+//
+
+#include <cstddef>
+#include <stdint.h>
+
+#ifndef _MESH_OPTIMIZE_H_
+#define _MESH_OPTIMIZE_H_
+
+// Merge vertices whose floatsPerVertex floats agree to within
+// tolerance, rewriting indices to the first of each group, and pack
+// the survivors to the front of vertices in their original order.
+// The first three floats are the position; kept vertices are found
+// through a grid of tolerance sized cells, looking in the neighbouring
+// cells as well. Returns the new number of vertices.
+size_t weldVertices(float* vertices, size_t vertexCount, int floatsPerVertex, uint32_t* indices, size_t indexCount, float tolerance);
+
+// Reorder the triangles of indices for an LRU post-transform vertex
+// cache of cacheSize entries, the one analyzeVertexCache( ) measures,
+// with Forsyth's linear-speed algorithm. Every index must be below
+// vertexCount.
+void optimizeVertexCache(uint32_t* indices, size_t indexCount, size_t vertexCount, unsigned int cacheSize);
+
+// Renumber the vertices in the order indices first use them, moving
+// them to match, and drop vertices no index refers to. Returns the
+// new number of vertices.
+size_t optimizeVertexFetch(float* vertices, size_t vertexCount, int floatsPerVertex, uint32_t* indices, size_t indexCount);
+
+// A view independent overdraw rank of the cluster of triangles in
+// indices: how far its area weighted centroid lies from meshCenter
+// along its average normal. Drawing clusters by decreasing key puts
+// first the ones out on the silhouette facing outward, which tend to
+// hide the rest from any direction.
+float overdrawSortKey(const float* vertices, int floatsPerVertex, const uint32_t* indices, size_t indexCount, const float meshCenter[3]);
+
+// Simulate an LRU post-transform cache of cacheSize entries over
+// indices. acmr is the average number of vertices transformed per
+// triangle and atvr per vertex referenced.
+void analyzeVertexCache(const uint32_t* indices, size_t indexCount, size_t vertexCount, unsigned int cacheSize, float* acmr, float* atvr);
+
+#endif
@@ -7,6 +7,9 @@
 //
 
 #include <tuple>
+#include <vector>
+#include <algorithm>
+#include <functional>
 #include <cstdlib>
 #include <cstdio>
 #include <sys/time.h>
@@ -23,6 +26,17 @@
 #include "SpinningLight.h"
 #include "Camera.h"
 #include "UtahTeapot.h"
+#include "Frustum.h"
+#include "InstanceStore.h"
+#include "InstanceBVH.h"
+#include "JobSystem.h"
+#include "ParallelCull.h"
+#include "OcclusionBuffer.h"
+#include "InstanceBuffer.h"
+#include "MaterialTable.h"
+#include "GLStateCache.h"
+#include "RenderQueue.h"
+#include "frustum_cull.h"
 
 void msglVersion(void){
   fprintf(stderr, "OpenGL Version Information:\n");
@@ -33,8 +47,55 @@ void msglVersion(void){
           glGetString(GL_SHADING_LANGUAGE_VERSION));
 }
 
+double microseconds(void){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1.0e6 + tv.tv_usec;
+}
+
 
 class TeapotVisionApp : public GLFWApp{
+public:
+  typedef enum{
+    // test only the teapot's center against the clip space cube
+    CULL_CENTER,
+    // test the teapot's bounding sphere against the frustum planes
+    CULL_SPHERE,
+    // the bounding sphere test, batched over the instance store
+    CULL_SIMD,
+    // traverse a hierarchy of boxes over the instance store
+    CULL_BVH,
+    // test first the plane that rejected each teapot last frame
+    CULL_COHERENT,
+    CULL_MODE_COUNT
+  }cullmode_t;
+
+  typedef enum{
+    WIREFRAME_OFF,
+    // every edge of the teapots' meshes
+    WIREFRAME_EDGES,
+    // only their creases and open boundaries
+    WIREFRAME_FEATURES,
+    WIREFRAME_MODE_COUNT
+  }wireframemode_t;
+
+  // Above this many teapots the BVH is used by default.
+  static const int bvhThreshold = 250000;
+  // Above this many teapots the SIMD and coherent modes run on
+  // all cores by default.
+  static const int parallelThreshold = 65536;
+  // The largest teapots on screen drawn into the occlusion buffer.
+  static const int occluderCount = 16;
+  // Levels of detail, the grids of lodGrids( ).
+  static const int LOD_LEVEL_COUNT = TeapotLodChain::DEFAULT_LEVEL_COUNT;
+  // Teapots drawn meshlet by meshlet have no instance.
+  static const uint32_t noInstance = 0xffffffff;
+  // Where the tessellated levels of detail are cached between runs,
+  // a file for each kind of tessellation.
+  static const char* meshCachePath(bool adaptive){
+    return adaptive ? "teapot_meshes_adaptive.cache" : "teapot_meshes.cache";
+  }
+
 private:
   float rotationDelta;
 
@@ -54,10 +115,99 @@ private:
   SpinningLight light0;
   SpinningLight light1; 
 
-  UtahTeapot* teapots[20];
-  const int teapotCount = 20;
+  std::vector<UtahTeapot*> teapots;
+  int teapotCount;
+  // Bounding spheres and visibility bits of the teapots,
+  // in the same order as teapots.
+  InstanceStore instances;
+  InstanceBVH instanceBVH;
+  JobSystem jobs;
+  ParallelCuller parallelCuller;
+  bool parallelCull;
+  // set when the cull itself filled in the visible list
+  bool visibleListReady;
 
   bool debugMaterialFlag;
+  // Edges drawn over the teapots in the main view and instead of them
+  // in the bird's eye view.
+  wireframemode_t wireframeMode;
+  // Every material drawn with, the teapots' and those of the bird's
+  // eye view, each once. The shader reads them from the table unless
+  // float textures are missing, then they go through the material
+  // uniforms.
+  MaterialTable materialTable;
+  bool useMaterialTable;
+  uint16_t visibleMaterial;
+  uint16_t hiddenMaterial;
+  uint16_t cameraMaterial;
+  uint16_t lightMaterial;
+  uint16_t edgeMaterial;
+  GLint uUseMaterialTable;
+  GLint uMaterialTable;
+  GLint uMaterialTableSize;
+  // The visible teapots not drawn meshlet by meshlet are drawn with
+  // one instanced draw per level of detail and mirror, their
+  // positions and material indices written straight into
+  // instanceBuffer once the draws are sorted, on the job system's
+  // threads when culling is parallel.
+  bool instancedDrawing;
+  InstanceBuffer instanceBuffer;
+  size_t instanceCount;
+  // Per visible teapot, its level of detail and then its place in
+  // instanceBuffer, or noInstance.
+  std::vector<uint32_t> instanceSlots;
+  int instancedDraws;
+
+  cullmode_t cullMode;
+  Frustum mainFrustum;
+  int insideCount;
+  int intersectingCount;
+  int outsideCount;
+  double cullMicroseconds;
+  // Skip culling altogether while the main camera does not move.
+  bool skipStaticFrames;
+  bool cullValid;
+  bool cullSkipped;
+  unsigned long lastCullVersion;
+  // The window size of the last cull; the contribution threshold and
+  // the levels of detail are in its pixels.
+  std::tuple<int, int> lastCullSize;
+  uint64_t planeTests;
+  // Teapots hidden behind the largest ones are dropped after culling.
+  OcclusionBuffer occlusionBuffer;
+  bool occlusionCull;
+  int occludedCount;
+  double occlusionMicroseconds;
+  // Teapots whose bounding sphere projects to a radius under
+  // contributionPixels are dropped; the rest get the coarsest mesh
+  // whose error on screen is at most lodErrorPixels.
+  bool contributionCull;
+  float contributionPixels;
+  TeapotLodChain lodChain;
+  float lodErrorPixels;
+  int contributionCulledCount;
+  int lodCounts[LOD_LEVEL_COUNT];
+  // Teapots whose bounding sphere projects to a radius of at least
+  // meshletPixels are drawn meshlet by meshlet, skipping the ones
+  // facing away or off screen. mainFocal is the distance at which a
+  // unit spans a pixel in the main camera.
+  bool meshletCull;
+  float meshletPixels;
+  float mainFocal;
+  MeshletStats meshletStats;
+  // The visible teapots are drawn in the order of their sort keys,
+  // by level of detail and front to back, instead of in array order.
+  bool sortDraws;
+  RenderQueue renderQueue;
+  double sortMicroseconds;
+  // Meshes are kept in buffers with 16 bit positions and octahedral
+  // normals instead of floats.
+  bool packedVertices;
+  // The chain's meshes, mapped from meshCachePath( ) once it is written.
+  MeshCache meshCache;
+  // Patches are tessellated more finely where they curve more, with
+  // matching steps along every shared edge, instead of on a uniform grid.
+  bool adaptiveTessellation;
 
   // Variables to set uniform params for lighting fragment shader 
   unsigned int uModelViewMatrix;
@@ -71,11 +221,27 @@ private:
   unsigned int uDiffuse;
   unsigned int uSpecular;
   unsigned int uShininess;
+  unsigned int uPackedVertices;
+  unsigned int uPackedOffset;
+  unsigned int uPackedScale;
   
 public:
   TeapotVisionApp(int argc, char* argv[]) :
     GLFWApp(argc, argv, std::string("Teapot Vision").c_str( ), 
-            600, 600){ }
+            600, 600), parallelCuller(jobs){
+    // teapot_vision [number of teapots]
+    teapotCount = 20;
+    if(argc > 1 && atoi(argv[1]) > 0){
+      teapotCount = atoi(argv[1]);
+    }
+  }
+
+  ~TeapotVisionApp( ){
+    UtahTeapot::releaseMeshes( );
+    for(size_t i = 0; i < teapots.size( ); i++){
+      delete teapots[i];
+    }
+  }
   
   void initCenterPosition( ){
     centerPosition = glm::vec3(0.0, 0.0, 0.0);
@@ -83,15 +249,25 @@ public:
   
   void initTeapots( ){
     std::srand(time(NULL));
+    // Keep the density of the default 20 teapots as the count grows.
+    float sceneRadius = 30.0 * std::max(1.0, sqrt(teapotCount / 20.0));
+    teapots.resize(teapotCount);
+    instances.clear( );
+    instances.reserve(teapotCount);
     for(int i = 0; i < teapotCount; i++){
       glm::vec3 _diffuseColor = glm::linearRand(glm::vec3(0.2), glm::vec3(1.0));
+      // Fifteenths of full intensity keep the teapots' colors to a
+      // few thousand shared materials.
+      _diffuseColor = glm::round(_diffuseColor * 15.0f) / 15.0f;
       //std::cerr << glm::to_string(_diffuseColor) << std::endl;
       glm::vec4 diffuseColor = glm::vec4(_diffuseColor, 1.0);
-      Material* m = new Material(glm::vec4(0.2, 0.2, 0.2, 1.0), diffuseColor, glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0);
-      glm::vec2 xy = glm::diskRand(30.0);
+      uint16_t m = materialTable.add(Material(glm::vec4(0.2, 0.2, 0.2, 1.0), diffuseColor, glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0));
+      glm::vec2 xy = glm::diskRand(sceneRadius);
       glm::vec3 position = glm::vec3(xy, 0.0);
       teapots[i] = new UtahTeapot(position, 1.0, m);
+      instances.add(teapots[i]->boundingCenter( ), teapots[i]->boundingRadius( ));
     }
+    instanceBVH.build(instances);
   }
 
   void initCamera( ){
@@ -123,6 +299,41 @@ public:
     initRotationDelta( );
     initLights( );
     debugMaterialFlag = false;
+    wireframeMode = WIREFRAME_OFF;
+    visibleMaterial = materialTable.add(Material(glm::vec4(0.2, 0.2, 0.2, 1.0), glm::vec4(1.0, 0.0, 0.0, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0));
+    hiddenMaterial = materialTable.add(Material(glm::vec4(0.2, 0.2, 0.2, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0));
+    cameraMaterial = materialTable.add(Material(glm::vec4(0.2, 0.2, 0.2, 1.0), glm::vec4(1.0, 1.0, 0.0, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0));
+    lightMaterial = materialTable.add(Material(glm::vec4(0.2, 0.2, 0.2, 1.0), glm::vec4(0.0, 0.0, 1.0, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0));
+    edgeMaterial = materialTable.add(Material(glm::vec4(0.0, 0.0, 0.0, 1.0), glm::vec4(0.1, 0.1, 0.1, 1.0), glm::vec4(0.0, 0.0, 0.0, 1.0), 1.0));
+    useMaterialTable = MaterialTable::isSupported( );
+    instancedDrawing = InstanceBuffer::isSupported( ) && useMaterialTable;
+    instanceCount = 0;
+    instancedDraws = 0;
+    cullMode = (teapotCount >= bvhThreshold) ? CULL_BVH : CULL_SIMD;
+    cullMicroseconds = 0.0;
+    skipStaticFrames = true;
+    parallelCull = (teapotCount >= parallelThreshold);
+    visibleListReady = false;
+    cullValid = false;
+    cullSkipped = false;
+    lastCullVersion = 0;
+    lastCullSize = std::make_tuple(0, 0);
+    planeTests = 0;
+    occlusionCull = true;
+    occludedCount = 0;
+    occlusionMicroseconds = 0.0;
+    contributionCull = true;
+    contributionPixels = 2.0;
+    lodErrorPixels = 1.0;
+    contributionCulledCount = 0;
+    std::fill(lodCounts, lodCounts + LOD_LEVEL_COUNT, 0);
+    meshletCull = true;
+    sortDraws = true;
+    sortMicroseconds = 0.0;
+    meshletPixels = 64.0;
+    mainFocal = 1.0;
+    packedVertices = true;
+    adaptiveTessellation = true;
 
     // Load shader programs
     const char* vertexShaderSource = "blinn_phong.vert.glsl";
@@ -131,8 +342,14 @@ public:
     VertexShader vertexShader(vertexShaderSource);
     shaderProgram.attach(vertexShader);
     shaderProgram.attach(fragmentShader);
+    glBindAttribLocation(shaderProgram.id( ), MeshBuffer::PACKED_NORMAL_ATTRIBUTE, "packedNormal");
+    glBindAttribLocation(shaderProgram.id( ), InstanceBuffer::POSITION_ATTRIBUTE, "instancePosition");
+    glBindAttribLocation(shaderProgram.id( ), InstanceBuffer::MATERIAL_ATTRIBUTE, "instanceMaterial");
     shaderProgram.link( );
-    shaderProgram.activate( );
+    // a new program, nothing the cache knows holds
+    GLStateCache& state = GLStateCache::shared( );
+    state.invalidate( );
+    state.use(shaderProgram);
     
     printf("Shader program built from %s and %s.\n",
            vertexShaderSource, fragmentShaderSource);
@@ -154,6 +371,28 @@ public:
     uDiffuse = glGetUniformLocation(shaderProgram.id( ), "diffuse");
     uSpecular = glGetUniformLocation(shaderProgram.id( ), "specular");
     uShininess = glGetUniformLocation(shaderProgram.id( ), "shininess");
+    uPackedVertices = glGetUniformLocation(shaderProgram.id( ), "packedVertices");
+    uPackedOffset = glGetUniformLocation(shaderProgram.id( ), "packedOffset");
+    uPackedScale = glGetUniformLocation(shaderProgram.id( ), "packedScale");
+    MeshBuffer::setPackedUniforms(uPackedVertices, uPackedOffset, uPackedScale);
+    state.uniform1i(uPackedVertices, 0);
+    MeshBuffer::setMirrorUniform(glGetUniformLocation(shaderProgram.id( ), "mirror"));
+    MeshBuffer::mirror(TeapotMesh::mirror(0));
+    InstanceBuffer::setInstancedUniform(glGetUniformLocation(shaderProgram.id( ), "instanced"));
+    state.uniform1i(glGetUniformLocation(shaderProgram.id( ), "instanced"), 0);
+    uUseMaterialTable = glGetUniformLocation(shaderProgram.id( ), "useMaterialTable");
+    uMaterialTable = glGetUniformLocation(shaderProgram.id( ), "materialTable");
+    uMaterialTableSize = glGetUniformLocation(shaderProgram.id( ), "materialTableSize");
+    state.uniform1i(uUseMaterialTable, useMaterialTable);
+    if(useMaterialTable){
+      materialTable.update( );
+      materialTable.bind(uMaterialTable, uMaterialTableSize, 1);
+    }
+    printf("%zu materials for %d teapots%s.\n", materialTable.size( ), teapotCount, useMaterialTable ? " in a material table" : "");
+    printf("Instanced drawing is %s.\n", instancedDrawing ? "on" : "not supported");
+
+    buildMeshes( );
+    loadMeshes( );
 
     glClearColor( 0.0f, 0.0f, 0.0f, 1.0f );
     glEnable(GL_DEPTH_TEST);
@@ -169,21 +408,31 @@ public:
     return true;
   }
   
-  void activateUniforms(glm::vec4& _light0, glm::vec4& _light1, Material* m){
-    glUniformMatrix4fv(uModelViewMatrix, 1, false, glm::value_ptr(modelViewMatrix));
-    glUniformMatrix4fv(uProjectionMatrix, 1, false, glm::value_ptr(projectionMatrix));
-    glUniformMatrix4fv(uNormalMatrix, 1, false, glm::value_ptr(normalMatrix));
+  // The material is an index into materialTable.
+  // Values already set are dropped by the GLStateCache; only the
+  // matrices and the material change from one teapot to the next.
+  void activateUniforms(glm::vec4& _light0, glm::vec4& _light1, uint16_t material){
+    GLStateCache& state = GLStateCache::shared( );
+    state.uniformMatrix4fv(uModelViewMatrix, glm::value_ptr(modelViewMatrix));
+    state.uniformMatrix4fv(uProjectionMatrix, glm::value_ptr(projectionMatrix));
+    state.uniformMatrix4fv(uNormalMatrix, glm::value_ptr(normalMatrix));
 
-    glUniform4fv(uLight0_position, 1, glm::value_ptr(_light0));
-    glUniform4fv(uLight0_color, 1, glm::value_ptr(light0.color( )));
+    state.uniform4fv(uLight0_position, glm::value_ptr(_light0));
+    state.uniform4fv(uLight0_color, glm::value_ptr(light0.color( )));
     
-    glUniform4fv(uLight1_position, 1, glm::value_ptr(_light1));
-    glUniform4fv(uLight1_color, 1, glm::value_ptr(light1.color( )));
+    state.uniform4fv(uLight1_position, glm::value_ptr(_light1));
+    state.uniform4fv(uLight1_color, glm::value_ptr(light1.color( )));
 
-    glUniform4fv(uAmbient, 1, glm::value_ptr(m->ambient));
-    glUniform4fv(uDiffuse, 1, glm::value_ptr(m->diffuse));
-    glUniform4fv(uSpecular, 1, glm::value_ptr(m->specular));
-    glUniform1f(uShininess, m->shininess);
+    if(useMaterialTable){
+      // no uniforms, the shader looks the material up
+      InstanceBuffer::material(material);
+    }else{
+      const Material& m = materialTable.material(material);
+      state.uniform4fv(uAmbient, glm::value_ptr(m.ambient));
+      state.uniform4fv(uDiffuse, glm::value_ptr(m.diffuse));
+      state.uniform4fv(uSpecular, glm::value_ptr(m.specular));
+      state.uniform1f(uShininess, m.shininess);
+    }
   }
   
   // The following function was programmged by:
@@ -191,12 +440,49 @@ public:
   // Earl Martin Momongan
   // martinmomongan@gmail.com
 
-  void checkVisibility(glm::mat4 clipPlaneMatrix){
+  void checkVisibility(float ratio, const std::tuple<int, int>& size){
 
     glm::vec4 position;  
-    glm::mat4 lookAtMatrix; // multiplied with clipPlaneMatrix
+    // multiplied with clipPlaneMatrix
+    const glm::mat4& lookAtMatrix = mainCamera.viewMatrix( );
+    const glm::mat4& clipPlaneMatrix = mainCamera.projectionMatrix(ratio);
+
+    visibleListReady = false;
+    // Nothing moved and the window kept its size since the last cull,
+    // the results still hold.
+    cullSkipped = skipStaticFrames && cullValid && mainCamera.version( ) == lastCullVersion && size == lastCullSize;
+    if(cullSkipped){
+      return;
+    }
+    lastCullVersion = mainCamera.version( );
+    lastCullSize = size;
+    cullValid = true;
+
+    mainFrustum = mainCamera.frustum(ratio);
+    if(parallelCull && (cullMode == CULL_SIMD || cullMode == CULL_COHERENT)){
+      parallelCuller.cull(mainFrustum, instances, cullMode == CULL_COHERENT);
+      planeTests = parallelCuller.planeTests;
+      visibleListReady = true;
+      return;
+    }
 
-    mainCamera.lookAtMatrix(lookAtMatrix);
+    if(cullMode == CULL_SPHERE){
+      checkVisibilitySphere( );
+      return;
+    }else if(cullMode == CULL_SIMD){
+      checkVisibilitySIMD( );
+      return;
+    }else if(cullMode == CULL_BVH){
+      if(parallelCull){
+        instanceBVH.cull(mainFrustum, instances, jobs);
+      }else{
+        instanceBVH.cull(mainFrustum, instances);
+      }
+      return;
+    }else if(cullMode == CULL_COHERENT){
+      planeTests = frustumCullSpheresCoherent(mainFrustum, &instances.x[0], &instances.y[0], &instances.z[0], &instances.r[0], instances.size( ), &instances.lastPlane[0], &instances.visibleMask[0], &instances.insideMask[0]);
+      return;
+    }
 
     for(int i = 0; i < teapotCount; i++){
 
@@ -207,12 +493,331 @@ public:
       if (position.x > -position.w && position.x < position.w &&
           position.y > -position.w && position.y < position.w &&
 		  position.z > -position.w && position.z < position.w) {
-        teapots[i]->visible = true;
+        instances.setContainment(i, Frustum::INTERSECTING);
       }
       else {
-        teapots[i]->visible = false;
+        instances.setContainment(i, Frustum::OUTSIDE);
+      }
+    }
+  }
+
+  // Cull each teapot's bounding sphere against the six planes of the
+  // main camera's frustum. The camera keeps the planes until it moves.
+  void checkVisibilitySphere( ){
+    for(int i = 0; i < teapotCount; i++){
+      instances.setContainment(i, mainFrustum.classifySphere(teapots[i]->boundingCenter( ), teapots[i]->boundingRadius( )));
+    }
+  }
+
+  // The same test run by the SIMD kernel straight over the
+  // instance store's arrays.
+  void checkVisibilitySIMD( ){
+    frustumCullSpheres(mainFrustum, &instances.x[0], &instances.y[0], &instances.z[0], &instances.r[0], instances.size( ), &instances.visibleMask[0], &instances.insideMask[0]);
+  }
+
+  // Draw the inner boxes of the teapots that cover the most of the
+  // screen into the occlusion buffer, then drop the visible teapots
+  // whose bounding spheres are hidden behind them from the visible
+  // list and the visibility bits.
+  void checkOcclusion(float ratio){
+    occludedCount = 0;
+    occlusionBuffer.setViewProjection(mainCamera.viewMatrix( ), mainCamera.projectionMatrix(ratio));
+    occlusionBuffer.clear( );
+    if(instances.visibleCount == 0){
+      return;
+    }
+
+    // radius over distance ranks the teapots by their size on screen
+    std::vector<std::pair<float, uint32_t> > ranked(instances.visibleCount);
+    for(size_t k = 0; k < instances.visibleCount; k++){
+      uint32_t i = instances.visibleList[k];
+      float distance = glm::length(instances.center(i) - mainCamera.eyePosition);
+      ranked[k] = std::make_pair(instances.r[i] / std::max(distance, 1e-3f), i);
+    }
+    size_t occluders = std::min(ranked.size( ), size_t(occluderCount));
+    std::partial_sort(ranked.begin( ), ranked.begin( ) + occluders, ranked.end( ), std::greater<std::pair<float, uint32_t> >( ));
+    for(size_t k = 0; k < occluders; k++){
+      glm::vec3 lo, hi;
+      teapots[ranked[k].second]->occluderBox(lo, hi);
+      occlusionBuffer.drawBox(lo, hi);
+    }
+    occlusionBuffer.buildPyramid( );
+
+    size_t kept = 0;
+    for(size_t k = 0; k < instances.visibleCount; k++){
+      uint32_t i = instances.visibleList[k];
+      if(occlusionBuffer.isSphereOccluded(instances.center(i), instances.r[i])){
+        instances.setContainment(i, Frustum::OUTSIDE);
+        occludedCount++;
+      }else{
+        instances.visibleList[kept++] = i;
+      }
+    }
+    instances.visibleCount = kept;
+  }
+
+  // Coarsest first.
+  static const int* lodGrids( ){
+    return TeapotLodChain::defaultGrids( );
+  }
+
+  static int lodGrid(int level){
+    return lodGrids( )[level];
+  }
+
+  // Map the levels of detail from the cache, or tessellate them once
+  // and cache them for the next start.
+  void buildMeshes( ){
+    double meshStart = microseconds( );
+    const char* path = meshCachePath(adaptiveTessellation);
+    uint64_t meshKey = MeshCache::key(lodGrids( ), LOD_LEVEL_COUNT, adaptiveTessellation);
+    if(meshCache.open(path, meshKey)){
+      printf("Meshes mapped from %s", path);
+    }else{
+      lodChain.build(lodGrids( ), LOD_LEVEL_COUNT, jobs, adaptiveTessellation);
+      if(MeshCache::write(path, meshKey, lodChain) && meshCache.open(path, meshKey)){
+        printf("Meshes tessellated and cached in %s", path);
+      }else{
+        printf("Meshes tessellated, %s could not be written", path);
+      }
+    }
+    if(meshCache.isOpen( )){
+      meshCache.restore(lodChain);
+    }
+    printf(" in %.1f ms.\n", (microseconds( ) - meshStart) / 1000.0);
+    printf("Level of detail errors with %s tessellation:", adaptiveTessellation ? "adaptive" : "uniform");
+    for(int k = 0; k < LOD_LEVEL_COUNT; k++){
+      printf(" grid %d: %.4f (%zu triangles)", lodGrid(k), lodChain.error[k], lodChain.triangles[k]);
+    }
+    printf("\n");
+    for(int k = 0; k < LOD_LEVEL_COUNT; k++){
+      const VertexCacheStats& before = lodChain.cacheBefore[k];
+      const VertexCacheStats& after = lodChain.cacheAfter[k];
+      printf("Grid %d: %zu vertices, ACMR %.3f, ATVR %.3f optimized to %zu vertices, ACMR %.3f, ATVR %.3f.\n", lodGrid(k), before.vertexCount, before.acmr, before.atvr, after.vertexCount, after.acmr, after.atvr);
+    }
+  }
+
+  // Put the level of detail chain in buffer objects, packed or not.
+  void loadMeshes( ){
+    size_t bytes = meshCache.isOpen( ) ? UtahTeapot::loadMeshes(meshCache, packedVertices) : UtahTeapot::loadMeshes(lodChain, packedVertices);
+    printf("Meshes loaded with %s vertices, %zu bytes of vertex data.\n", packedVertices ? "packed" : "float", bytes);
+  }
+
+  // Whether visible teapot i is near or large enough on screen to be
+  // drawn meshlet by meshlet.
+  bool drawsClusters(uint32_t i){
+    float depth = viewDepth(i);
+    return meshletCull && (depth <= instances.r[i] || instances.r[i] * mainFocal / depth >= meshletPixels);
+  }
+
+  // Draw the visible teapots not drawn meshlet by meshlet, grouped by
+  // level of detail, with an instanced draw per level and mirror.
+  void drawInstances(const glm::mat4& lookAtMatrix, glm::vec4& _light0, glm::vec4& _light1){
+    // count the teapots of each level, then place each in its level's run
+    size_t first[LOD_LEVEL_COUNT + 1];
+    std::fill(first, first + LOD_LEVEL_COUNT + 1, 0);
+    instanceSlots.resize(instances.visibleCount);
+    for(size_t k = 0; k < instances.visibleCount; k++){
+      uint32_t i = drawOrder(k);
+      if(drawsClusters(i)){
+        instanceSlots[k] = noInstance;
+      }else{
+        instanceSlots[k] = instances.lod[i];
+        first[instances.lod[i] + 1]++;
+      }
+    }
+    for(int level = 0; level < LOD_LEVEL_COUNT; level++){
+      first[level + 1] += first[level];
+    }
+    instanceCount = first[LOD_LEVEL_COUNT];
+    instancedDraws = 0;
+    if(instanceCount == 0){
+      return;
+    }
+    size_t next[LOD_LEVEL_COUNT];
+    std::copy(first, first + LOD_LEVEL_COUNT, next);
+    for(size_t k = 0; k < instances.visibleCount; k++){
+      if(instanceSlots[k] != noInstance){
+        instanceSlots[k] = uint32_t(next[instanceSlots[k]]++);
       }
     }
+    TeapotInstance* mapped = instanceBuffer.map(instanceCount);
+    if(!mapped){
+      // the stream grows for them at the next frame; until then they
+      // are drawn one at a time
+      for(size_t k = 0; k < instances.visibleCount; k++){
+        if(instanceSlots[k] == noInstance){
+          continue;
+        }
+        uint32_t i = drawOrder(k);
+        modelViewMatrix = teapotModelView(lookAtMatrix, i);
+        normalMatrix = glm::inverseTranspose(modelViewMatrix);
+        GLStateCache::shared( ).use(shaderProgram);
+        activateUniforms(_light0, _light1, teapots[i]->materialIndex);
+        teapots[i]->draw(lodGrid(instances.lod[i]));
+      }
+      instanceCount = 0;
+      return;
+    }
+    JobSystem::rangefn_t write = [&](size_t begin, size_t end, unsigned int){
+      for(size_t k = begin; k < end; k++){
+        if(instanceSlots[k] == noInstance){
+          continue;
+        }
+        const UtahTeapot* teapot = teapots[drawOrder(k)];
+        TeapotInstance& instance = mapped[instanceSlots[k]];
+        instance.position[0] = teapot->position.x;
+        instance.position[1] = teapot->position.y;
+        instance.position[2] = teapot->position.z;
+        instance.scale = teapot->scale;
+        instance.material = teapot->materialIndex;
+        instance.pad = 0;
+      }
+    };
+    if(parallelCull){
+      jobs.parallelFor(instances.visibleCount, 4096, write);
+    }else{
+      write(0, instances.visibleCount, 0);
+    }
+    instanceBuffer.unmap( );
+
+    // the instances carry their positions and materials
+    modelViewMatrix = lookAtMatrix;
+    normalMatrix = glm::inverseTranspose(modelViewMatrix);
+    GLStateCache::shared( ).use(shaderProgram);
+    activateUniforms(_light0, _light1, visibleMaterial);
+    for(int level = 0; level < LOD_LEVEL_COUNT; level++){
+      size_t count = first[level + 1] - first[level];
+      if(count > 0){
+        instanceBuffer.bind(first[level]);
+        UtahTeapot::drawInstanced(lodGrid(level), GLsizei(count));
+        instanceBuffer.unbind( );
+        instancedDraws += TeapotMesh::MIRROR_COUNT;
+      }
+    }
+  }
+
+  // Key the visible teapots' draws and sort them. All use the one
+  // program; the material only counts when it is set with uniforms.
+  void queueDraws( ){
+    double sortStart = microseconds( );
+    renderQueue.clear( );
+    renderQueue.setDepthRange(mainCamera.near, mainCamera.far);
+    for(size_t k = 0; k < instances.visibleCount; k++){
+      uint32_t i = instances.visibleList[k];
+      uint16_t material = useMaterialTable ? 0 : teapots[i]->materialIndex;
+      renderQueue.push(0, instances.lod[i], material, viewDepth(i), i);
+    }
+    renderQueue.sort( );
+    sortMicroseconds = microseconds( ) - sortStart;
+  }
+
+  // The k-th visible teapot in the order they are drawn.
+  uint32_t drawOrder(size_t k){
+    return sortDraws ? renderQueue.items[k] : instances.visibleList[k];
+  }
+
+  // Teapot i's model-view matrix, scaled like its bounds, its meshlets'
+  // spheres and its instance so every path draws it at one size.
+  glm::mat4 teapotModelView(const glm::mat4& lookAtMatrix, uint32_t i){
+    return glm::scale(glm::translate(lookAtMatrix, teapots[i]->position), glm::vec3(teapots[i]->scale));
+  }
+
+  // Distance of the center of teapot i in front of the main camera.
+  float viewDepth(uint32_t i){
+    const glm::mat4& view = mainCamera.viewMatrix( );
+    glm::vec3 c = instances.center(i);
+    return -(view[0][2] * c.x + view[1][2] * c.y + view[2][2] * c.z + view[3][2]);
+  }
+
+  // Drop the visible teapots too small to matter and pick the level
+  // of detail of the rest from their size on screen in a window
+  // height pixels tall. focal is the distance at which one unit spans
+  // one pixel; the error is measured at the sphere's nearest point.
+  void checkContribution(float ratio, float height){
+    float focal = mainCamera.projectionMatrix(ratio)[1][1] * 0.5f * height;
+    float near = mainCamera.near;
+    mainFocal = focal;
+    contributionCulledCount = 0;
+    std::fill(lodCounts, lodCounts + LOD_LEVEL_COUNT, 0);
+    size_t kept = 0;
+    for(size_t k = 0; k < instances.visibleCount; k++){
+      uint32_t i = instances.visibleList[k];
+      float depth = viewDepth(i);
+      float radius = instances.r[i];
+      // the camera inside or right at the sphere counts as full screen
+      float pixels = (depth > radius) ? radius * focal / depth : focal;
+      if(contributionCull && pixels < contributionPixels){
+        instances.setContainment(i, Frustum::OUTSIDE);
+        contributionCulledCount++;
+        continue;
+      }
+      float pixelsPerUnit = teapots[i]->scale * focal / std::max(depth - radius, near);
+      int level = lodChain.select(pixelsPerUnit, lodErrorPixels);
+      instances.lod[i] = uint8_t(level);
+      lodCounts[level]++;
+      instances.visibleList[kept++] = i;
+    }
+    instances.visibleCount = kept;
+  }
+
+  void countContainment( ){
+    int visibleCount = int(instances.visibleCount);
+    insideCount = 0;
+    for(size_t i = 0; i < instances.maskWords( ); i++){
+      insideCount += __builtin_popcount(instances.insideMask[i]);
+    }
+    intersectingCount = visibleCount - insideCount;
+    outsideCount = teapotCount - visibleCount - occludedCount - contributionCulledCount;
+  }
+
+  void printCullStats( ){
+    const char* modeName[] = {"Center point", "Bounding sphere", "SIMD bounding sphere", "BVH bounding sphere", "Coherent bounding sphere"};
+    countContainment( );
+    printf("%s culling", modeName[cullMode]);
+    if(cullMode == CULL_SIMD){
+      printf(" (%s)", frustumCullKernelName( ));
+    }
+    if(cullMode == CULL_BVH){
+      printf(" (%zu nodes, %zu spheres)", instanceBVH.nodesVisited, instanceBVH.spheresTested);
+    }
+    if(parallelCull && (cullMode == CULL_SIMD || cullMode == CULL_COHERENT || cullMode == CULL_BVH)){
+      printf(" on %u threads", jobs.workerCount( ));
+    }else if(cullMode == CULL_COHERENT){
+      printf(" (%.2f plane tests per teapot)", double(planeTests) / teapotCount);
+    }
+    printf(": %d inside, %d intersecting, %d outside in %.1f us%s.\n", insideCount, intersectingCount, outsideCount, cullMicroseconds, cullSkipped ? " (camera unchanged, skipped)" : "");
+    if(occlusionCull){
+      printf("Occlusion culling: %d occluded by %d occluders (%d triangles) in %.1f us.\n", occludedCount, occlusionBuffer.occludersDrawn, occlusionBuffer.trianglesDrawn, occlusionMicroseconds);
+    }
+    if(contributionCull){
+      printf("Contribution culling: %d under %.1f pixels.\n", contributionCulledCount, contributionPixels);
+    }
+    int triangles = 0;
+    printf("Level of detail (%.2f pixels of error):", lodErrorPixels);
+    for(int k = 0; k < LOD_LEVEL_COUNT; k++){
+      printf(" grid %d: %d", lodGrid(k), lodCounts[k]);
+      triangles += lodCounts[k] * int(lodChain.triangles[k]);
+    }
+    printf(", %d triangles", triangles);
+    if(meshletCull){
+      printf("\nMeshlets: %zu drawn, %zu facing away, %zu off screen", meshletStats.drawn, meshletStats.backFacing, meshletStats.outside);
+    }
+    if(instancedDrawing){
+      StreamBuffer& stream = instanceBuffer.stream( );
+      printf("\nInstanced: %zu teapots in %d draws, %s, %zu frames stalled %.1f us on fences", instanceCount, instancedDraws, stream.isPersistent( ) ? "persistently mapped" : "copied with glBufferSubData", stream.stalls( ), stream.stallMicroseconds( ));
+    }
+    if(sortDraws){
+      printf("\nRender queue: %zu draws sorted in %d passes in %.1f us", renderQueue.size( ), renderQueue.sortPasses, sortMicroseconds);
+    }
+    if(useMaterialTable){
+      printf("\nMaterial table: %zu materials, written %zu times", materialTable.size( ), materialTable.uploadCount( ));
+    }
+    const GLStateCache& state = GLStateCache::shared( );
+    if(state.isEnabled( )){
+      printf("\nGL state cache: %zu of %zu calls dropped last frame", state.droppedCalls( ), state.issuedCalls( ) + state.droppedCalls( ));
+    }
+    printf("\n");
   }
 
   bool render( ){
@@ -221,17 +826,43 @@ public:
     glm::mat4 lookAtMatrix;
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    GLStateCache::shared( ).beginFrame( );
+    // wait for the draws of FRAME_COUNT frames ago to free their region
+    instanceBuffer.stream( ).beginFrame( );
+
+    // materials changed since the last frame go to the shader's table
+    if(useMaterialTable && materialTable.update( )){
+      GLStateCache::shared( ).use(shaderProgram);
+      materialTable.bind(uMaterialTable, uMaterialTableSize, 1);
+    }
 
     std::tuple<int, int> w = windowSize( );
     double ratio = double(std::get<0>(w)) / double(std::get<1>(w));
 
-    glm::mat4 clipPlaneMatrix;
-    mainCamera.perspectiveMatrix(clipPlaneMatrix, ratio);
-    checkVisibility(clipPlaneMatrix);
-
-    currentCamera->perspectiveMatrix(projectionMatrix, ratio);
+    double cullStart = microseconds( );
+    checkVisibility(ratio, w);
+    if(!cullSkipped && !visibleListReady){
+      // Gather the visible teapots so drawing never scans them all.
+      instances.compact( );
+    }
+    cullMicroseconds = microseconds( ) - cullStart;
+    if(!cullSkipped){
+      double occlusionStart = microseconds( );
+      if(occlusionCull){
+        checkOcclusion(ratio);
+      }else{
+        occludedCount = 0;
+      }
+      occlusionMicroseconds = microseconds( ) - occlusionStart;
+      checkContribution(ratio, std::get<1>(w));
+      if(sortDraws){
+        queueDraws( );
+      }
+    }
 
-    currentCamera->lookAtMatrix(lookAtMatrix);
+    // Both are cached by the camera until it moves.
+    projectionMatrix = currentCamera->projectionMatrix(ratio);
+    lookAtMatrix = currentCamera->viewMatrix( );
 
     // Set light & material properties for the teapot;
     // lights are transformed by current modelview matrix
@@ -239,70 +870,138 @@ public:
     _light0 = lookAtMatrix * light0.position4( );
     _light1 = lookAtMatrix * light1.position4( );
     
+    bool features = (wireframeMode == WIREFRAME_FEATURES);
     if(currentCamera == &mainCamera){
-      for(int i = 0; i < teapotCount; i++){
-        if(teapots[i]->visible){
-          // If the teapot is visible and it's in the main camera mode
-          // then draw the teapot; otherwise don't
-          modelViewMatrix = glm::translate(lookAtMatrix, teapots[i]->position);
-          //modelViewMatrix = lookAtMatrix;
-          normalMatrix = glm::inverseTranspose(modelViewMatrix);
-          shaderProgram.activate( );
-          activateUniforms(_light0, _light1, teapots[i]->material);
-          //no_lightShaderProgram.activate( );
-          teapots[i]->draw( );
+      if(wireframeMode != WIREFRAME_OFF){
+        // push the faces back so their edges are not hidden by them
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(1.0, 1.0);
+      }
+      meshletStats.clear( );
+      bool instanced = instancedDrawing && wireframeMode == WIREFRAME_OFF;
+      // Only the visible teapots are drawn in the main camera mode
+      for(size_t k = 0; k < instances.visibleCount; k++){
+        uint32_t i = drawOrder(k);
+        bool clustered = drawsClusters(i);
+        if(instanced && !clustered){
+          continue;
+        }
+        modelViewMatrix = teapotModelView(lookAtMatrix, i);
+        //modelViewMatrix = lookAtMatrix;
+        normalMatrix = glm::inverseTranspose(modelViewMatrix);
+        GLStateCache::shared( ).use(shaderProgram);
+        activateUniforms(_light0, _light1, teapots[i]->materialIndex);
+        //no_lightShaderProgram.activate( );
+        int grid = lodGrid(instances.lod[i]);
+        if(clustered){
+          teapots[i]->drawClusters(grid, mainFrustum, mainCamera.eyePosition, meshletStats);
+        }else{
+          teapots[i]->draw(grid);
         }
+        if(wireframeMode != WIREFRAME_OFF){
+          activateUniforms(_light0, _light1, edgeMaterial);
+          teapots[i]->drawEdges(grid, features);
+        }
+      }
+      if(instanced){
+        drawInstances(lookAtMatrix, _light0, _light1);
+      }else{
+        instanceCount = 0;
+        instancedDraws = 0;
       }
+      glDisable(GL_POLYGON_OFFSET_FILL);
     }else{
           // If this is the bird's eye view then draw everything
           // but with different materials
-      Material redMaterial = Material(glm::vec4(0.2, 0.2, 0.2, 1.0), glm::vec4(1.0, 0.0, 0.0, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0);
-      Material whiteMaterial = Material(glm::vec4(0.2, 0.2, 0.2, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0);
-      Material yellowMaterial = Material(glm::vec4(0.2, 0.2, 0.2, 1.0), glm::vec4(1.0, 1.0, 0.0, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0);
-      Material blueMaterial = Material(glm::vec4(0.2, 0.2, 0.2, 1.0), glm::vec4(0.0, 0.0, 1.0, 1.0), glm::vec4(1.0, 1.0, 1.0, 1.0), 100.0);
-      Material* currentMaterial = &redMaterial;
-      shaderProgram.activate( );
+      uint16_t currentMaterial = visibleMaterial;
+      GLStateCache::shared( ).use(shaderProgram);
       for(int i = 0; i < teapotCount; i++){
-        // multiply the lookAtMatrix with the teapot's translation
+        // multiply the lookAtMatrix with the teapot's translation and scale
         // to position the teapot in the right spot.
-        modelViewMatrix = glm::translate(lookAtMatrix, teapots[i]->position);
+        modelViewMatrix = teapotModelView(lookAtMatrix, i);
         normalMatrix = glm::inverseTranspose(modelViewMatrix);
-        if(teapots[i]->visible){
-          currentMaterial = &redMaterial;
+        if(instances.isVisible(i)){
+          currentMaterial = visibleMaterial;
         }else{
-          currentMaterial = &whiteMaterial;
+          currentMaterial = hiddenMaterial;
         }
         if(debugMaterialFlag){
-          activateUniforms(_light0, _light1, teapots[i]->material);
+          activateUniforms(_light0, _light1, teapots[i]->materialIndex);
         }else{
           activateUniforms(_light0, _light1, currentMaterial);
         }
-        teapots[i]->draw( );
+        if(wireframeMode != WIREFRAME_OFF){
+          teapots[i]->drawEdges(7, features);
+        }else{
+          teapots[i]->draw( );
+        }
       }
       modelViewMatrix = glm::translate(lookAtMatrix, mainCamera.eyePosition);
       normalMatrix = glm::inverseTranspose(modelViewMatrix);
-      activateUniforms(_light0, _light1, &yellowMaterial);
+      activateUniforms(_light0, _light1, cameraMaterial);
+      // the camera and lights are drawn in immediate mode
+      MeshBuffer::unpackedVertices( );
       mainCamera.draw( );
       mainCamera.drawViewFrustum(ratio);
 
       modelViewMatrix = glm::translate(lookAtMatrix, light0.position);
       normalMatrix = glm::inverseTranspose(modelViewMatrix);
-      activateUniforms(_light0, _light1, &blueMaterial);
+      activateUniforms(_light0, _light1, lightMaterial);
       light0.draw( );
 
       modelViewMatrix = glm::translate(lookAtMatrix, light1.position);
       normalMatrix = glm::inverseTranspose(modelViewMatrix);
-      activateUniforms(_light0, _light1, &blueMaterial);
+      activateUniforms(_light0, _light1, lightMaterial);
       light1.draw( );
     }
+    // the draws reading this frame's instances are issued
+    instanceBuffer.stream( ).endFrame( );
 
     
     if(isKeyPressed('Q')){
       end( );      
     }else if(isKeyPressed(GLFW_KEY_EQUAL)){
-
+      lodErrorPixels *= 1.25;
+      cullValid = false;
+      printf("Level of detail error budget is %.2f pixels.\n", lodErrorPixels);
+      keyUp(GLFW_KEY_EQUAL);
     }else if(isKeyPressed(GLFW_KEY_MINUS)){
-
+      lodErrorPixels /= 1.25;
+      cullValid = false;
+      printf("Level of detail error budget is %.2f pixels.\n", lodErrorPixels);
+      keyUp(GLFW_KEY_MINUS);
+    }else if(isKeyPressed(']')){
+      contributionPixels *= 1.25;
+      cullValid = false;
+      printf("Teapots under %.1f pixels are dropped.\n", contributionPixels);
+      keyUp(']');
+    }else if(isKeyPressed('[')){
+      contributionPixels /= 1.25;
+      cullValid = false;
+      printf("Teapots under %.1f pixels are dropped.\n", contributionPixels);
+      keyUp('[');
+    }else if(isKeyPressed('U')){
+      packedVertices = !packedVertices;
+      UtahTeapot::releaseMeshes( );
+      loadMeshes( );
+      keyUp('U');
+    }else if(isKeyPressed('F')){
+      adaptiveTessellation = !adaptiveTessellation;
+      UtahTeapot::releaseMeshes( );
+      meshCache.close( );
+      buildMeshes( );
+      loadMeshes( );
+      cullValid = false;
+      keyUp('F');
+    }else if(isKeyPressed('E')){
+      meshletCull = !meshletCull;
+      printf("Meshlet culling is %s.\n", meshletCull ? "on" : "off");
+      keyUp('E');
+    }else if(isKeyPressed('V')){
+      contributionCull = !contributionCull;
+      cullValid = false;
+      printf("Contribution culling is %s.\n", contributionCull ? "on" : "off");
+      keyUp('V');
     }else if(isKeyPressed('R')){
       /*initEyePosition( );
       initUpVector( );*/
@@ -352,12 +1051,61 @@ public:
       light1.toggle( );
     }else if(isKeyPressed('3')){
       debugMaterialFlag = !debugMaterialFlag;
+    }else if(isKeyPressed('4')){
+      wireframeMode = wireframemode_t((wireframeMode + 1) % WIREFRAME_MODE_COUNT);
+      const char* names[WIREFRAME_MODE_COUNT] = {"off", "every edge", "feature edges"};
+      printf("Wireframe: %s.\n", names[wireframeMode]);
+      keyUp('4');
+    }else if(isKeyPressed('5')){
+      if(InstanceBuffer::isSupported( ) && useMaterialTable){
+        instancedDrawing = !instancedDrawing;
+        printf("Instanced drawing is %s.\n", instancedDrawing ? "on" : "off");
+      }
+      keyUp('5');
+    }else if(isKeyPressed('6')){
+      GLStateCache& state = GLStateCache::shared( );
+      state.enable(!state.isEnabled( ));
+      printf("GL state cache is %s.\n", state.isEnabled( ) ? "on" : "off");
+      keyUp('6');
+    }else if(isKeyPressed('7')){
+      sortDraws = !sortDraws;
+      cullValid = false;
+      printf("Draws are %s.\n", sortDraws ? "sorted by level of detail and front to back" : "in array order");
+      keyUp('7');
+    }else if(isKeyPressed('8')){
+      GLStateCache& state = GLStateCache::shared( );
+      state.setErrorCheck(GLStateCache::errorcheck_t((state.errorCheck( ) + 1) % 3));
+      printf("OpenGL errors are checked %s.\n", GLStateCache::errorCheckName(state.errorCheck( )));
+      keyUp('8');
     }else if(isKeyPressed('P')){
       currentCamera = &mainCamera;
     }else if(isKeyPressed('B')){
       currentCamera = &bevCamera;
+    }else if(isKeyPressed('C')){
+      cullMode = cullmode_t((cullMode + 1) % CULL_MODE_COUNT);
+      cullValid = false;
+      keyUp('C');
+      printCullStats( );
+    }else if(isKeyPressed('I')){
+      printCullStats( );
+    }else if(isKeyPressed('M')){
+      parallelCull = !parallelCull;
+      cullValid = false;
+      printf("Parallel culling is %s.\n", parallelCull ? "on" : "off");
+      keyUp('M');
+    }else if(isKeyPressed('T')){
+      skipStaticFrames = !skipStaticFrames;
+      cullValid = false;
+      printf("Culling on static frames is %s.\n", skipStaticFrames ? "skipped" : "repeated");
+      keyUp('T');
+    }else if(isKeyPressed('Z')){
+      occlusionCull = !occlusionCull;
+      cullValid = false;
+      printf("Occlusion culling is %s.\n", occlusionCull ? "on" : "off");
+      keyUp('Z');
     }
-    return !msglError( );
+    // the one error check of the frame, as the cache's policy has it
+    return GLStateCache::shared( ).endFrame( );
   }
     
 };
@@ -0,0 +1,101 @@
+//
+// Microbenchmark of the CPU Bezier tessellator.
+//
+// Tessellates the teapot's 32 patches over and over at a range of
+// grid sizes with every kernel and reports millions of vertices per
+// second, then times building the app's level of detail chain,
+// uniform and adaptive, in parallel, and compares their triangles
+// and errors. Needs no window or OpenGL context.
+//
+// tessellate_bench [seconds per measurement]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/time.h>
+
+#include "bezier_tessellate.h"
+#include "glut_teapot.h"
+#include "JobSystem.h"
+#include "TeapotLod.h"
+#include "TeapotMesh.h"
+
+typedef void (*kernel_t)(const float cp[4][4][3], int uSteps, int vSteps, float* vertices);
+
+double microseconds(void){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1.0e6 + tv.tv_usec;
+}
+
+// Millions of vertices per second tessellating every patch at grid.
+double measure(kernel_t kernel, const std::vector<GLfloat>& patches, int grid, double seconds){
+  int count = int(patches.size( ) / 48);
+  size_t side = grid + 1;
+  std::vector<float> vertices(side * side * TESSELLATE_VERTEX_FLOATS);
+  double vertexCount = 0.0;
+  double start = microseconds( );
+  double elapsed = 0.0;
+  do{
+    for(int n = 0; n < count; n++){
+      kernel((const float (*)[4][3])&patches[n * 48], grid, grid, &vertices[0]);
+    }
+    vertexCount += double(count) * side * side;
+    elapsed = microseconds( ) - start;
+  }while(elapsed < seconds * 1.0e6);
+  return vertexCount / elapsed;
+}
+
+int main(int argc, char* argv[]){
+  double seconds = (argc > 1 && atof(argv[1]) > 0.0) ? atof(argv[1]) : 0.25;
+  std::vector<GLfloat> patches(_glutTeapotPatchCount( ) * 48);
+  for(int n = 0; n < _glutTeapotPatchCount( ); n++){
+    _glutTeapotPatch(n, (GLfloat (*)[4][3])&patches[n * 48]);
+  }
+
+  const char* names[] = {"scalar", "SSE2", "AVX2"};
+  std::vector<kernel_t> kernels;
+  kernels.push_back(tessellatePatchScalar);
+#if defined(__x86_64__) || defined(__i386__)
+  kernels.push_back(tessellatePatchSSE2);
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+    kernels.push_back(tessellatePatchAVX2);
+  }
+#endif
+
+  const int grids[] = {2, 4, 7, 10, 16, 32, 64};
+  printf("Mvertices/s, dispatching to %s\n", tessellateKernelName( ));
+  printf("%6s", "grid");
+  for(size_t k = 0; k < kernels.size( ); k++){
+    printf(" %10s", names[k]);
+  }
+  printf("\n");
+  for(size_t g = 0; g < sizeof(grids) / sizeof(grids[0]); g++){
+    printf("%6d", grids[g]);
+    for(size_t k = 0; k < kernels.size( ); k++){
+      printf(" %10.1f", measure(kernels[k], patches, grids[g], seconds));
+    }
+    printf("\n");
+  }
+
+  // the chain of meshes the app builds at startup, both kinds
+  JobSystem jobs;
+  TeapotLodChain chains[2];
+  for(int adaptive = 0; adaptive < 2; adaptive++){
+    TeapotLodChain& chain = chains[adaptive];
+    double start = microseconds( );
+    chain.build(TeapotLodChain::defaultGrids( ), TeapotLodChain::DEFAULT_LEVEL_COUNT, jobs, adaptive != 0);
+    double elapsed = microseconds( ) - start;
+    size_t vertexCount = 0;
+    for(size_t k = 0; k < chain.size( ); k++){
+      vertexCount += chain.levels[k].vertexCount( );
+    }
+    printf("%zu %s levels of detail, %zu vertices on %u threads in %.1f us.\n", chain.size( ), adaptive ? "adaptive" : "uniform", vertexCount, jobs.workerCount( ), elapsed);
+  }
+  // adaptive levels are held to the uniform levels' error
+  for(size_t k = 0; k < chains[0].size( ); k++){
+    printf("Grid %d: uniform %zu triangles at error %.4f, adaptive %zu at %.4f.\n", chains[0].levels[k].grid, chains[0].triangles[k], chains[0].error[k], chains[1].triangles[k], chains[1].error[k]);
+  }
+  return 0;
+}